@@ -0,0 +1,68 @@
+#
+# bench/common.sh
+#
+# Temporary cluster shared by the benchmark scripts. Source this file after
+# setting BENCH_PORT and optionally BENCH_MAX_CONNECTIONS.
+#
+
+PG_CONFIG="${PG_CONFIG:-pg_config}"
+BINDIR="$("$PG_CONFIG" --bindir)"
+BENCH_PORT="${BENCH_PORT:-54329}"
+BENCH_MAX_CONNECTIONS="${BENCH_MAX_CONNECTIONS:-100}"
+
+export PGHOST=127.0.0.1
+export PGPORT="$BENCH_PORT"
+export PGDATABASE=postgres
+export PGUSER=postgres
+unset PGOPTIONS
+
+DATADIR="$(mktemp -d "${TMPDIR:-/tmp}/pg_retire_bench.XXXXXX")"
+
+#
+# Stop and remove the temporary cluster
+#
+function cleanup_cluster()
+{
+  "$BINDIR/pg_ctl" -D "$DATADIR" -m immediate stop > /dev/null 2>&1 || true
+  rm -rf "$DATADIR"
+}
+trap cleanup_cluster EXIT
+
+#
+# Initialize and start the temporary cluster with pg_retire preloaded.
+# Extra lines for postgresql.conf can be given as arguments.
+#
+function start_cluster()
+{
+  echo "==> Initialize a temporary cluster in $DATADIR"
+
+  "$BINDIR/initdb" -D "$DATADIR" -A trust -U postgres > /dev/null
+  cat >> "$DATADIR/postgresql.conf" <<CONF
+shared_preload_libraries = 'pg_retire'
+listen_addresses = '127.0.0.1'
+port = $BENCH_PORT
+unix_socket_directories = '$DATADIR'
+max_connections = $BENCH_MAX_CONNECTIONS
+CONF
+  printf "%s\n" "$@" >> "$DATADIR/postgresql.conf"
+
+  "$BINDIR/pg_ctl" -D "$DATADIR" -l "$DATADIR/server.log" -w start > /dev/null
+}
+
+#
+# Change a parameter that needs restart, and restart the cluster
+#
+function restart_cluster()
+{
+  printf "%s\n" "$@" >> "$DATADIR/postgresql.conf"
+  "$BINDIR/pg_ctl" -D "$DATADIR" -l "$DATADIR/server.log" -w restart > /dev/null
+}
+
+#
+# Print the median of numbers given as arguments
+#
+function median()
+{
+  printf "%s\n" "$@" | sort -g | awk '{ v[NR] = $1 } END {
+    if (NR % 2) print v[(NR + 1) / 2]; else print (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
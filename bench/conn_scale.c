@@ -0,0 +1,253 @@
+/*-------------------------------------------------------------------------
+ *
+ * conn_scale.c
+ *		Measure the system cost of pg_retire with many connections.
+ *
+ * Opens idle connections, which only connect, and active connections,
+ * which run a long statement, then measures over a period the following
+ * for all of their backends:
+ *
+ *	alarms/s	pg_retire alarms fired, from pg_retire_stats
+ *	ctxsw/s		voluntary and involuntary context switches, from
+ *				/proc/<pid>/status
+ *	cpu_%		user and system CPU time, from /proc/<pid>/stat, in percent
+ *				of one CPU
+ *	probe_ms	estimated time spent probing clients in the alarm handler,
+ *				from the probe_cost_ns histogram of pg_retire_histograms()
+ *	bytes/s		bytes written by the backends, from wchar in /proc/<pid>/io,
+ *				which are all pg_retire probes while the statements run
+ *
+ * One line is printed:
+ *	label idle active seconds alarms/s ctxsw/s cpu_% probe_ms bytes/s
+ *
+ * This must run on the same host as the server, as the user running it.
+ * The pg_retire extension must be created in the database connected to.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+
+typedef struct ProcUsage
+{
+	long long	ctxsw;			/* context switches */
+	long long	cpu_ticks;		/* utime + stime in clock ticks */
+	long long	wchar;			/* bytes written */
+} ProcUsage;
+
+typedef struct ModuleUsage
+{
+	double		alarms;			/* alarms fired */
+	double		probe_ns;		/* estimated time spent in probes */
+} ModuleUsage;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+			"usage: %s [-d conninfo] [-i idle] [-a active] [-s seconds] [-l label]\n",
+			progname);
+	exit(2);
+}
+
+/*
+ * Add the usage of a process read from /proc. A process that has gone
+ * meanwhile is skipped.
+ */
+static void
+add_proc_usage(int pid, ProcUsage *usage)
+{
+	char		path[64];
+	char		line[256];
+	FILE	   *fp;
+	long long	v;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if ((fp = fopen(path, "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), fp))
+			if (sscanf(line, "voluntary_ctxt_switches: %lld", &v) == 1 ||
+				sscanf(line, "nonvoluntary_ctxt_switches: %lld", &v) == 1)
+				usage->ctxsw += v;
+		fclose(fp);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if ((fp = fopen(path, "r")) != NULL)
+	{
+		long long	utime;
+		long long	stime;
+
+		/* comm may contain spaces, so scan from its closing parenthesis */
+		if (fgets(line, sizeof(line), fp) && strrchr(line, ')') &&
+			sscanf(strrchr(line, ')') + 2,
+				   "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lld %lld",
+				   &utime, &stime) == 2)
+			usage->cpu_ticks += utime + stime;
+		fclose(fp);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/io", pid);
+	if ((fp = fopen(path, "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), fp))
+			if (sscanf(line, "wchar: %lld", &v) == 1)
+				usage->wchar += v;
+		fclose(fp);
+	}
+}
+
+static void
+get_proc_usage(const int *pids, int npids, ProcUsage *usage)
+{
+	int			i;
+
+	memset(usage, 0, sizeof(*usage));
+	for (i = 0; i < npids; i++)
+		add_proc_usage(pids[i], usage);
+}
+
+static double
+query_double(PGconn *conn, const char *query)
+{
+	PGresult   *res = PQexec(conn, query);
+	double		v = 0;
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "%s", PQerrorMessage(conn));
+		exit(1);
+	}
+	if (PQntuples(res) > 0 && !PQgetisnull(res, 0, 0))
+		v = atof(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	return v;
+}
+
+static void
+get_module_usage(PGconn *conn, ModuleUsage *usage)
+{
+	usage->alarms = query_double(conn,
+								 "SELECT sum(alarms) FROM pg_retire_stats");
+	usage->probe_ns = query_double(conn,
+								   "SELECT sum(count * (lower_bound + coalesce(upper_bound, lower_bound)) / 2.0) "
+								   "FROM pg_retire_histograms() WHERE histogram = 'probe_cost_ns'");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *conninfo = "";
+	const char *label = "-";
+	int			nidle = 1000;
+	int			nactive = 100;
+	int			seconds = 60;
+	char		query[64];
+	PGconn	   *monitor;
+	PGconn	  **conns;
+	int		   *pids;
+	ProcUsage	proc_start;
+	ProcUsage	proc_end;
+	ModuleUsage mod_start;
+	ModuleUsage mod_end;
+	long		ticks = sysconf(_SC_CLK_TCK);
+	int			n;
+	int			c;
+	int			i;
+
+	while ((c = getopt(argc, argv, "d:i:a:s:l:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				conninfo = optarg;
+				break;
+			case 'i':
+				nidle = atoi(optarg);
+				break;
+			case 'a':
+				nactive = atoi(optarg);
+				break;
+			case 's':
+				seconds = atoi(optarg);
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	n = nidle + nactive;
+	if (nidle < 0 || nactive < 0 || n == 0 || seconds <= 0)
+		usage(argv[0]);
+
+	monitor = PQconnectdb(conninfo);
+	if (PQstatus(monitor) != CONNECTION_OK)
+	{
+		fprintf(stderr, "%s", PQerrorMessage(monitor));
+		return 1;
+	}
+
+	/*
+	 * Open the connections, and start the statements on the active ones.
+	 * They run a little longer than the measurement.
+	 */
+	conns = calloc(n, sizeof(PGconn *));
+	pids = calloc(n, sizeof(int));
+	snprintf(query, sizeof(query), "SELECT pg_sleep(%d)", seconds + 60);
+	for (i = 0; i < n; i++)
+	{
+		conns[i] = PQconnectdb(conninfo);
+		if (PQstatus(conns[i]) != CONNECTION_OK)
+		{
+			fprintf(stderr, "connection %d: %s", i, PQerrorMessage(conns[i]));
+			return 1;
+		}
+		pids[i] = PQbackendPID(conns[i]);
+
+		if (i < nactive && !PQsendQuery(conns[i], query))
+		{
+			fprintf(stderr, "connection %d: %s", i, PQerrorMessage(conns[i]));
+			return 1;
+		}
+	}
+
+	/* Let the connection storm settle */
+	sleep(2);
+
+	get_module_usage(monitor, &mod_start);
+	get_proc_usage(pids, n, &proc_start);
+	sleep(seconds);
+	get_proc_usage(pids, n, &proc_end);
+	get_module_usage(monitor, &mod_end);
+
+	printf("%s %d %d %d %.1f %.1f %.2f %.3f %.1f\n",
+		   label, nidle, nactive, seconds,
+		   (mod_end.alarms - mod_start.alarms) / seconds,
+		   (double) (proc_end.ctxsw - proc_start.ctxsw) / seconds,
+		   (double) (proc_end.cpu_ticks - proc_start.cpu_ticks) * 100.0 / ticks / seconds,
+		   (mod_end.probe_ns - mod_start.probe_ns) / 1000000.0,
+		   (double) (proc_end.wchar - proc_start.wchar) / seconds);
+
+	for (i = 0; i < n; i++)
+	{
+		if (i < nactive)
+		{
+			PGcancel   *cancel = PQgetCancel(conns[i]);
+			char		errbuf[256];
+
+			PQcancel(cancel, errbuf, sizeof(errbuf));
+			PQfreeCancel(cancel);
+		}
+		PQfinish(conns[i]);
+	}
+	PQfinish(monitor);
+
+	return 0;
+}
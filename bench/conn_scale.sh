@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+#
+# bench/conn_scale.sh
+#
+# Measure the system cost of pg_retire with thousands of connections,
+# mostly idle plus some running a long statement, on a temporary cluster.
+# pg_retire is measured disabled and enabled at several intervals.
+#
+# The following environment variables can be set:
+#   PG_CONFIG         pg_config of the server to use (default: pg_config)
+#   BENCH_PORT        port of the temporary cluster (default: 54329)
+#   BENCH_IDLE        idle connections (default: 9000)
+#   BENCH_ACTIVE      active connections (default: 1000)
+#   BENCH_DURATION    seconds of each measurement (default: 60)
+#   BENCH_INTERVALS   pg_retire.interval values to try (default: "1 10")
+#
+
+set -euo pipefail
+
+BENCH_IDLE="${BENCH_IDLE:-9000}"
+BENCH_ACTIVE="${BENCH_ACTIVE:-1000}"
+BENCH_DURATION="${BENCH_DURATION:-60}"
+BENCH_INTERVALS="${BENCH_INTERVALS:-1 10}"
+BENCH_MAX_CONNECTIONS=$((BENCH_IDLE + BENCH_ACTIVE + 10))
+
+# Each connection needs a descriptor here and one in its backend
+ulimit -n $((BENCH_MAX_CONNECTIONS + 100)) 2> /dev/null || \
+  echo "warning: could not raise the open files limit" >&2
+
+source "$(dirname "$0")/common.sh"
+
+CONN_SCALE="$(dirname "$0")/conn_scale"
+
+start_cluster "shared_buffers = 128MB"
+"$BINDIR/psql" -q -c "CREATE EXTENSION pg_retire"
+
+echo "==> $BENCH_IDLE idle and $BENCH_ACTIVE active connections, ${BENCH_DURATION}s"
+printf "%-10s %10s %10s %8s %8s %10s\n" \
+  "config" "alarms/s" "ctxsw/s" "cpu_%" "probe_ms" "bytes/s"
+
+configs=("off|-c pg_retire.enable=off")
+for interval in $BENCH_INTERVALS; do
+  configs+=("on/${interval}s|-c pg_retire.enable=on -c pg_retire.interval=$interval")
+done
+
+for config in "${configs[@]}"; do
+  PGOPTIONS="${config#*|}" "$CONN_SCALE" -i "$BENCH_IDLE" -a "$BENCH_ACTIVE" \
+    -s "$BENCH_DURATION" -l "${config%%|*}" | \
+    awk '{ printf "%-10s %10s %10s %8s %8s %10s\n", $1, $5, $6, $7, $8, $9 }'
+done
@@ -0,0 +1,525 @@
+/*-------------------------------------------------------------------------
+ *
+ * kill_latency.c
+ *		Measure how long pg_retire takes to cancel statements whose client
+ *		has gone away.
+ *
+ * N client processes connect, start a long statement and report their
+ * backend pid. Then all of them are killed in one of the following ways,
+ * and the time until each backend stops running the statement is taken
+ * by polling pg_stat_activity.
+ *
+ *	fin		the client closes the socket normally (FIN)
+ *	rst		the client closes the socket with SO_LINGER 0 (RST)
+ *	sigkill	the client process is killed with SIGKILL
+ *	freeze	the clients connect through a local TCP proxy, which stops
+ *			forwarding in both directions but keeps the connections open,
+ *			like a peer that stopped responding
+ *
+ * One line is printed:
+ *	label mode sessions canceled min_ms p50_ms p90_ms p99_ms max_ms
+ * Percentiles are taken over the canceled sessions. Sessions not canceled
+ * within the timeout are only counted.
+ *
+ * The connection is given by -d and the usual PG* environment variables.
+ * pg_retire settings are usually given through PGOPTIONS.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+
+#define DEFAULT_QUERY		"SELECT pg_sleep(3600)"
+#define POLL_INTERVAL_MS	10
+#define PROXY_BUFSIZE		65536
+
+typedef enum
+{
+	KILL_FIN,
+	KILL_RST,
+	KILL_SIGKILL,
+	KILL_FREEZE
+} KillMode;
+
+static const char *const kill_mode_names[] = {"fin", "rst", "sigkill", "freeze"};
+
+typedef struct Session
+{
+	pid_t		client_pid;		/* client process */
+	int			backend_pid;	/* its backend */
+	double		killed_at;		/* when the client was killed, in ms */
+	double		latency;		/* until canceled in ms, or -1 */
+} Session;
+
+/* Client socket, used in the signal handlers of a client process */
+static volatile int client_sock = -1;
+
+/* Set in the proxy process on SIGUSR1 */
+static volatile sig_atomic_t proxy_frozen = 0;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+			"usage: %s [-d conninfo] [-n sessions] [-m fin|rst|sigkill|freeze]\n"
+			"          [-q query] [-t timeout_sec] [-l label]\n",
+			progname);
+	exit(2);
+}
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Signal handlers of a client process. Unread input is discarded first,
+ * because closing a socket with unread data sends RST instead of FIN.
+ */
+static void
+close_with_fin(int signo)
+{
+	char		buf[1024];
+
+	(void) signo;
+	while (recv(client_sock, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	_exit(0);
+}
+
+static void
+close_with_rst(int signo)
+{
+	struct linger lg;
+
+	(void) signo;
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	setsockopt(client_sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	_exit(0);
+}
+
+/*
+ * run_client
+ *		Body of a client process.
+ *
+ * Starts the statement, writes the backend pid to the pipe, and waits to
+ * be killed. Writes 0 if the statement could not be started.
+ */
+static void
+run_client(const char *conninfo, const char *query, int pipefd)
+{
+	PGconn	   *conn;
+	int			pid = 0;
+
+	conn = PQconnectdb(conninfo);
+	if (PQstatus(conn) == CONNECTION_OK && PQsendQuery(conn, query))
+	{
+		client_sock = PQsocket(conn);
+		pid = PQbackendPID(conn);
+	}
+	else
+		fprintf(stderr, "client: %s", PQerrorMessage(conn));
+
+	signal(SIGUSR1, close_with_fin);
+	signal(SIGUSR2, close_with_rst);
+
+	if (write(pipefd, &pid, sizeof(pid)) != sizeof(pid) || pid == 0)
+		_exit(1);
+
+	for (;;)
+		pause();
+}
+
+static void
+freeze_proxy(int signo)
+{
+	(void) signo;
+
+	proxy_frozen = 1;
+}
+
+/*
+ * forward
+ *		Copy what is readable from one socket to another.
+ *
+ * Returns false at EOF or on error.
+ */
+static bool
+forward(int from, int to)
+{
+	char		buf[PROXY_BUFSIZE];
+	ssize_t		n;
+	ssize_t		off = 0;
+
+	n = read(from, buf, sizeof(buf));
+	if (n <= 0)
+		return false;
+
+	while (off < n)
+	{
+		ssize_t		w = write(to, buf + off, n - off);
+
+		if (w < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		off += w;
+	}
+	return true;
+}
+
+/*
+ * run_proxy
+ *		Body of the proxy process.
+ *
+ * Every connection accepted is paired with a new connection to the
+ * server. On SIGUSR1, nothing is forwarded any more, but all sockets are
+ * kept open until the process is terminated.
+ */
+static void
+run_proxy(int listenfd, const struct sockaddr_in *server, int maxpairs)
+{
+	struct pollfd *pfds;
+	int			npairs = 0;
+	int			i;
+
+	signal(SIGUSR1, freeze_proxy);
+
+	/* pfds[0] is the listen socket, then client and server of each pair */
+	pfds = calloc(1 + 2 * maxpairs, sizeof(struct pollfd));
+	pfds[0].fd = listenfd;
+	pfds[0].events = POLLIN;
+
+	for (;;)
+	{
+		if (proxy_frozen)
+		{
+			pause();
+			continue;
+		}
+
+		if (poll(pfds, 1 + 2 * npairs, -1) < 0)
+			continue;
+
+		if ((pfds[0].revents & POLLIN) && npairs < maxpairs)
+		{
+			int			c = accept(listenfd, NULL, NULL);
+			int			s = socket(AF_INET, SOCK_STREAM, 0);
+
+			if (c >= 0 && s >= 0 &&
+				connect(s, (const struct sockaddr *) server, sizeof(*server)) == 0)
+			{
+				pfds[1 + 2 * npairs].fd = c;
+				pfds[1 + 2 * npairs].events = POLLIN;
+				pfds[2 + 2 * npairs].fd = s;
+				pfds[2 + 2 * npairs].events = POLLIN;
+				npairs++;
+			}
+			else
+			{
+				if (c >= 0)
+					close(c);
+				if (s >= 0)
+					close(s);
+			}
+		}
+
+		for (i = 0; i < npairs && !proxy_frozen; i++)
+		{
+			struct pollfd *c = &pfds[1 + 2 * i];
+			struct pollfd *s = &pfds[2 + 2 * i];
+
+			if (c->fd < 0)
+				continue;
+
+			if (((c->revents & (POLLIN | POLLHUP | POLLERR)) && !forward(c->fd, s->fd)) ||
+				((s->revents & (POLLIN | POLLHUP | POLLERR)) && !forward(s->fd, c->fd)))
+			{
+				close(c->fd);
+				close(s->fd);
+				c->fd = -1;
+				s->fd = -1;
+			}
+		}
+	}
+}
+
+/*
+ * start_proxy
+ *		Fork the proxy to the server that conn is connected to.
+ *
+ * Returns the pid of the proxy, and sets the port it listens on.
+ */
+static pid_t
+start_proxy(PGconn *conn, int maxpairs, int *port)
+{
+	struct sockaddr_in server;
+	struct sockaddr_in addr;
+	socklen_t	len = sizeof(addr);
+	int			listenfd;
+	pid_t		pid;
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server.sin_port = htons(atoi(PQport(conn)));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd < 0 ||
+		bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		listen(listenfd, maxpairs) < 0 ||
+		getsockname(listenfd, (struct sockaddr *) &addr, &len) < 0)
+	{
+		perror("proxy");
+		exit(1);
+	}
+	*port = ntohs(addr.sin_port);
+
+	pid = fork();
+	if (pid == 0)
+		run_proxy(listenfd, &server, maxpairs);
+	close(listenfd);
+
+	return pid;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double		x = *(const double *) a;
+	double		y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(const double *sorted, int n, double p)
+{
+	int			i = (int) (p * (n - 1) + 0.5);
+
+	return sorted[i];
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *conninfo = "";
+	const char *query = DEFAULT_QUERY;
+	const char *label = "-";
+	int			nsessions = 10;
+	int			timeout = 30;
+	KillMode	mode = KILL_FIN;
+	char		client_conninfo[1024];
+	PGconn	   *monitor;
+	Session    *sessions;
+	pid_t		proxy_pid = 0;
+	int			pipefd[2];
+	int			ncanceled = 0;
+	double	   *latencies;
+	double		deadline;
+	int			c;
+	int			i;
+
+	while ((c = getopt(argc, argv, "d:n:m:q:t:l:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				conninfo = optarg;
+				break;
+			case 'n':
+				nsessions = atoi(optarg);
+				break;
+			case 'm':
+				for (i = 0; i <= KILL_FREEZE; i++)
+					if (strcmp(optarg, kill_mode_names[i]) == 0)
+						break;
+				if (i > KILL_FREEZE)
+					usage(argv[0]);
+				mode = (KillMode) i;
+				break;
+			case 'q':
+				query = optarg;
+				break;
+			case 't':
+				timeout = atoi(optarg);
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (nsessions <= 0)
+		usage(argv[0]);
+
+	monitor = PQconnectdb(conninfo);
+	if (PQstatus(monitor) != CONNECTION_OK)
+	{
+		fprintf(stderr, "%s", PQerrorMessage(monitor));
+		return 1;
+	}
+
+	snprintf(client_conninfo, sizeof(client_conninfo), "%s", conninfo);
+	if (mode == KILL_FREEZE)
+	{
+		int			port;
+
+		proxy_pid = start_proxy(monitor, nsessions, &port);
+		snprintf(client_conninfo, sizeof(client_conninfo),
+				 "%s host=127.0.0.1 port=%d", conninfo, port);
+	}
+
+	/*
+	 * Start the clients, and wait until all of them run the statement.
+	 */
+	sessions = calloc(nsessions, sizeof(Session));
+	if (pipe(pipefd) < 0)
+	{
+		perror("pipe");
+		return 1;
+	}
+	for (i = 0; i < nsessions; i++)
+	{
+		pid_t		pid = fork();
+
+		if (pid == 0)
+		{
+			close(pipefd[0]);
+			run_client(client_conninfo, query, pipefd[1]);
+		}
+		sessions[i].client_pid = pid;
+		if (read(pipefd[0], &sessions[i].backend_pid, sizeof(int)) != sizeof(int) ||
+			sessions[i].backend_pid == 0)
+		{
+			fprintf(stderr, "could not start session %d\n", i);
+			return 1;
+		}
+		sessions[i].latency = -1;
+	}
+
+	/* Let the statements start running */
+	sleep(1);
+
+	/*
+	 * Kill them all.
+	 */
+	if (mode == KILL_FREEZE)
+		kill(proxy_pid, SIGUSR1);
+	for (i = 0; i < nsessions; i++)
+	{
+		sessions[i].killed_at = now_ms();
+		switch (mode)
+		{
+			case KILL_FIN:
+				kill(sessions[i].client_pid, SIGUSR1);
+				break;
+			case KILL_RST:
+				kill(sessions[i].client_pid, SIGUSR2);
+				break;
+			case KILL_SIGKILL:
+				kill(sessions[i].client_pid, SIGKILL);
+				break;
+			case KILL_FREEZE:
+				break;
+		}
+	}
+
+	/*
+	 * Poll until no backend runs the statement any more.
+	 */
+	deadline = now_ms() + timeout * 1000.0;
+	while (ncanceled < nsessions && now_ms() < deadline)
+	{
+		PGresult   *res;
+		int			ntuples;
+
+		usleep(POLL_INTERVAL_MS * 1000);
+
+		res = PQexec(monitor,
+					 "SELECT pid FROM pg_stat_activity "
+					 "WHERE state = 'active' AND pid <> pg_backend_pid()");
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			fprintf(stderr, "%s", PQerrorMessage(monitor));
+			return 1;
+		}
+		ntuples = PQntuples(res);
+
+		for (i = 0; i < nsessions; i++)
+		{
+			int			j;
+
+			if (sessions[i].latency >= 0)
+				continue;
+
+			for (j = 0; j < ntuples; j++)
+				if (atoi(PQgetvalue(res, j, 0)) == sessions[i].backend_pid)
+					break;
+
+			if (j == ntuples)
+			{
+				sessions[i].latency = now_ms() - sessions[i].killed_at;
+				ncanceled++;
+			}
+		}
+		PQclear(res);
+	}
+
+	/*
+	 * Clean up the clients and the proxy that are still there.
+	 */
+	for (i = 0; i < nsessions; i++)
+		kill(sessions[i].client_pid, SIGKILL);
+	if (proxy_pid != 0)
+		kill(proxy_pid, SIGKILL);
+	while (wait(NULL) > 0)
+		;
+
+	latencies = calloc(nsessions, sizeof(double));
+	for (i = 0, c = 0; i < nsessions; i++)
+		if (sessions[i].latency >= 0)
+			latencies[c++] = sessions[i].latency;
+	qsort(latencies, ncanceled, sizeof(double), cmp_double);
+
+	if (ncanceled > 0)
+		printf("%s %s %d %d %.1f %.1f %.1f %.1f %.1f\n",
+			   label, kill_mode_names[mode], nsessions, ncanceled,
+			   latencies[0],
+			   percentile(latencies, ncanceled, 0.50),
+			   percentile(latencies, ncanceled, 0.90),
+			   percentile(latencies, ncanceled, 0.99),
+			   latencies[ncanceled - 1]);
+	else
+		printf("%s %s %d 0 - - - - -\n",
+			   label, kill_mode_names[mode], nsessions);
+
+	PQfinish(monitor);
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env bash
+#
+# bench/kill_latency.sh
+#
+# Measure time from client death to statement cancel for every failure
+# mode of bench/kill_latency and every detection strategy of pg_retire,
+# on a temporary cluster.
+#
+# The following environment variables can be set:
+#   PG_CONFIG         pg_config of the server to use (default: pg_config)
+#   BENCH_PORT        port of the temporary cluster (default: 54329)
+#   BENCH_SESSIONS    sessions killed at once (default: 50)
+#   BENCH_INTERVAL    pg_retire.interval (default: 1)
+#   BENCH_TIMEOUT     seconds to wait for cancels (default: 30)
+#   BENCH_MODES       failure modes (default: "fin rst sigkill freeze")
+#
+
+set -euo pipefail
+
+BENCH_SESSIONS="${BENCH_SESSIONS:-50}"
+BENCH_INTERVAL="${BENCH_INTERVAL:-1}"
+BENCH_TIMEOUT="${BENCH_TIMEOUT:-30}"
+BENCH_MODES="${BENCH_MODES:-fin rst sigkill freeze}"
+BENCH_MAX_CONNECTIONS=$((BENCH_SESSIONS + 10))
+
+source "$(dirname "$0")/common.sh"
+
+KILL_LATENCY="$(dirname "$0")/kill_latency"
+
+start_cluster "pg_retire.interval = $BENCH_INTERVAL"
+
+#
+# Run all failure modes with the given strategy name and PGOPTIONS
+#
+function run_modes()
+{
+  local name="$1"
+  local mode
+
+  for mode in $BENCH_MODES; do
+    PGOPTIONS="$2" "$KILL_LATENCY" -n "$BENCH_SESSIONS" -m "$mode" \
+      -t "$BENCH_TIMEOUT" -l "$name" | \
+      awk '{ printf "%-10s %-8s %8s %8s %8s %8s %8s %8s %8s\n", $1, $2, $3, $4, $5, $6, $7, $8, $9 }'
+  done
+}
+
+echo "==> $BENCH_SESSIONS sessions, pg_retire.interval = ${BENCH_INTERVAL}s, times in ms"
+printf "%-10s %-8s %8s %8s %8s %8s %8s %8s %8s\n" \
+  "strategy" "mode" "sessions" "canceled" "min" "p50" "p90" "p99" "max"
+
+run_modes "off" "-c pg_retire.enable=off"
+for probe in write peek tcp_info; do
+  run_modes "$probe" "-c pg_retire.enable=on -c pg_retire.probe_mode=$probe"
+done
+
+for worker in epoll sock_diag; do
+  restart_cluster "pg_retire.worker_mode = $worker"
+  run_modes "$worker" "-c pg_retire.enable=on"
+done
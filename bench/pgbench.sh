@@ -0,0 +1,90 @@
+#!/usr/bin/env bash
+#
+# bench/pgbench.sh
+#
+# Measure the overhead of pg_retire on OLTP workloads.
+#
+# A temporary cluster is started with pg_retire preloaded, and pgbench
+# select-only and TPC-B-like runs are compared with pg_retire disabled,
+# enabled at several intervals and in each probe mode. Statements of these
+# workloads are much shorter than pg_retire.interval, so what is measured
+# is the cost of arming and disarming the timer on every statement.
+#
+# The following environment variables can be set:
+#   PG_CONFIG       pg_config of the server to use (default: pg_config)
+#   BENCH_PORT      port of the temporary cluster (default: 54329)
+#   BENCH_SCALE     pgbench scale factor (default: 10)
+#   BENCH_CLIENTS   pgbench clients (default: 8)
+#   BENCH_JOBS      pgbench threads (default: 4)
+#   BENCH_DURATION  seconds of each run (default: 30)
+#   BENCH_RUNS      runs per configuration, the median is reported (default: 3)
+#   BENCH_INTERVALS pg_retire.interval values to try (default: "1 10")
+#
+
+set -euo pipefail
+
+BENCH_SCALE="${BENCH_SCALE:-10}"
+BENCH_CLIENTS="${BENCH_CLIENTS:-8}"
+BENCH_JOBS="${BENCH_JOBS:-4}"
+BENCH_DURATION="${BENCH_DURATION:-30}"
+BENCH_RUNS="${BENCH_RUNS:-3}"
+BENCH_INTERVALS="${BENCH_INTERVALS:-1 10}"
+BENCH_MAX_CONNECTIONS=$((BENCH_CLIENTS + 10))
+
+source "$(dirname "$0")/common.sh"
+
+#
+# Run pgbench with the given PGOPTIONS and workload options,
+# and print median tps and average latency
+#
+function run_pgbench()
+{
+  local pgoptions="$1"
+  shift
+  local -a tps=() lat=()
+  local out i
+
+  for i in $(seq 1 "$BENCH_RUNS"); do
+    out="$(PGOPTIONS="$pgoptions" "$BINDIR/pgbench" -n -c "$BENCH_CLIENTS" \
+             -j "$BENCH_JOBS" -T "$BENCH_DURATION" "$@" 2>&1)"
+    tps+=("$(awk '/^tps = / { print $3; exit }' <<< "$out")")
+    lat+=("$(awk '/^latency average = / { print $4; exit }' <<< "$out")")
+  done
+
+  echo "$(median "${tps[@]}") $(median "${lat[@]}")"
+}
+
+start_cluster
+"$BINDIR/pgbench" -i -q -s "$BENCH_SCALE" > /dev/null 2>&1
+
+configs=("off|-c pg_retire.enable=off")
+for interval in $BENCH_INTERVALS; do
+  for mode in write peek tcp_info; do
+    configs+=("$mode/${interval}s|-c pg_retire.enable=on -c pg_retire.interval=$interval -c pg_retire.probe_mode=$mode")
+  done
+done
+
+for workload in select-only tpcb; do
+  if [[ "$workload" == "select-only" ]]; then
+    opts=(-S)
+  else
+    opts=()
+  fi
+
+  echo "==> $workload: $BENCH_CLIENTS clients, ${BENCH_DURATION}s x $BENCH_RUNS runs"
+  printf "%-16s %12s %9s %12s %9s\n" "config" "tps" "delta" "latency ms" "delta"
+
+  base_tps=""
+  base_lat=""
+  for config in "${configs[@]}"; do
+    name="${config%%|*}"
+    read -r tps lat <<< "$(run_pgbench "${config#*|}" "${opts[@]}")"
+    if [[ -z "$base_tps" ]]; then
+      base_tps="$tps"
+      base_lat="$lat"
+    fi
+    awk -v n="$name" -v t="$tps" -v l="$lat" -v bt="$base_tps" -v bl="$base_lat" \
+      'BEGIN { printf "%-16s %12.1f %+8.2f%% %12.3f %+8.2f%%\n",
+               n, t, (t - bt) * 100 / bt, l, (l - bl) * 100 / bl }'
+  done
+done
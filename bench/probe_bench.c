@@ -0,0 +1,228 @@
+/*-------------------------------------------------------------------------
+ *
+ * probe_bench.c
+ *		Microbenchmark of the probes of pg_retire, without a server.
+ *
+ * pg_retire_probe.c is built in, and each probe is run in a loop on the
+ * backend end of a Unix-domain socketpair or a loopback TCP connection.
+ * The backend end is non-blocking, as in a backend. The client end is
+ * either
+ *
+ *	open	read continuously by a thread
+ *	full	never read, and the backend end filled until write() blocks
+ *	closed	closed
+ *
+ * For each transport, client state and probe, one line is printed:
+ *	transport state probe result probes/s ns/probe
+ * where result is that of the last probe: alive, down, eagain, or n/a if
+ * the probe is not available on the transport.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "pg_retire_probe.h"
+
+#define BATCH		1000
+
+typedef enum
+{
+	CLIENT_OPEN,
+	CLIENT_FULL,
+	CLIENT_CLOSED
+} ClientState;
+
+static const char *const state_names[] = {"open", "full", "closed"};
+
+typedef enum
+{
+	PROBE_WRITE_V3,
+	PROBE_WRITE_V2,
+	PROBE_PEEK,
+	PROBE_TCP_INFO
+} ProbeKind;
+
+static const char *const probe_names[] = {"write-v3", "write-v2", "peek", "tcp_info"};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Open a connected pair, fds[0] for the backend and fds[1] for the client
+ */
+static int
+open_pair(bool tcp, int fds[2])
+{
+	struct sockaddr_in addr;
+	socklen_t	len = sizeof(addr);
+	int			listenfd;
+
+	if (!tcp)
+		return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd < 0 ||
+		bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		listen(listenfd, 1) < 0 ||
+		getsockname(listenfd, (struct sockaddr *) &addr, &len) < 0)
+		return -1;
+
+	fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[1] < 0 ||
+		connect(fds[1], (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		return -1;
+	fds[0] = accept(listenfd, NULL, NULL);
+	close(listenfd);
+
+	return fds[0] < 0 ? -1 : 0;
+}
+
+static void *
+drain(void *arg)
+{
+	int			fd = *(int *) arg;
+	char		buf[65536];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+static int
+probe(ProbeKind kind, int sock, CharBuffer *rest, uint64_t *last_bytes_acked)
+{
+	switch (kind)
+	{
+		case PROBE_WRITE_V3:
+			return send_dummy_message(sock, 3, rest);
+		case PROBE_WRITE_V2:
+			return send_dummy_message(sock, 2, rest);
+		case PROBE_PEEK:
+			return peek_client_socket(sock, 0);
+		case PROBE_TCP_INFO:
+			return check_tcp_info(sock, 6, 1000, last_bytes_acked);
+	}
+	return 0;
+}
+
+static void
+run(bool tcp, ClientState state, ProbeKind kind, double duration)
+{
+	int			fds[2];
+	pthread_t	reader;
+	CharBuffer	rest;
+	uint64_t	last_bytes_acked = 0;
+	long		nprobes = 0;
+	int			result = 0;
+	double		start;
+	double		elapsed;
+	int			i;
+
+	if (open_pair(tcp, fds) < 0)
+	{
+		perror("open_pair");
+		exit(1);
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	rest.pos = 0;
+
+	switch (state)
+	{
+		case CLIENT_OPEN:
+			pthread_create(&reader, NULL, drain, &fds[1]);
+			break;
+		case CLIENT_FULL:
+			{
+				char		buf[4096];
+
+				memset(buf, 0, sizeof(buf));
+				while (write(fds[0], buf, sizeof(buf)) > 0)
+					;
+				while (write(fds[0], buf, 1) > 0)
+					;
+			}
+			break;
+		case CLIENT_CLOSED:
+			close(fds[1]);
+			usleep(10000);
+			break;
+	}
+
+	start = now_sec();
+	do
+	{
+		for (i = 0; i < BATCH; i++)
+		{
+			probe_would_block = 0;
+			result = probe(kind, fds[0], &rest, &last_bytes_acked);
+		}
+		nprobes += BATCH;
+		elapsed = now_sec() - start;
+	} while (elapsed < duration);
+
+	printf("%-5s %-7s %-9s %-7s %12.0f %10.1f\n",
+		   tcp ? "tcp" : "unix", state_names[state], probe_names[kind],
+		   result < 0 ? "down" : result > 0 ? "n/a" :
+		   probe_would_block ? "eagain" : "alive",
+		   nprobes / elapsed, elapsed * 1000000000.0 / nprobes);
+
+	if (state == CLIENT_OPEN)
+	{
+		shutdown(fds[0], SHUT_RDWR);
+		pthread_join(reader, NULL);
+	}
+	close(fds[0]);
+	if (state != CLIENT_CLOSED)
+		close(fds[1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	double		duration = 0.5;
+	int			t;
+	int			s;
+	int			k;
+
+	if (argc > 1)
+		duration = atof(argv[1]);
+	if (duration <= 0)
+	{
+		fprintf(stderr, "usage: %s [seconds_per_case]\n", argv[0]);
+		return 2;
+	}
+
+	/* A backend ignores SIGPIPE, and so must we for the closed client */
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-5s %-7s %-9s %-7s %12s %10s\n",
+		   "trans", "client", "probe", "result", "probes/s", "ns/probe");
+
+	for (t = 0; t <= 1; t++)
+		for (s = CLIENT_OPEN; s <= CLIENT_CLOSED; s++)
+			for (k = PROBE_WRITE_V3; k <= PROBE_TCP_INFO; k++)
+				run(t == 1, (ClientState) s, (ProbeKind) k, duration);
+
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*-------------------------------------------------------------------------
+ *
+ * stream.c
+ *		Measure large result streaming under pg_retire probing.
+ *
+ * Streams a result set of the given size with COPY TO STDOUT or with a
+ * SELECT read in single-row mode, optionally reading no faster than the
+ * given rate to emulate a slow client. Probes written by pg_retire while a
+ * result is being sent must neither slow it down much nor corrupt the
+ * protocol stream, so the number of rows received is checked and any error
+ * reported by libpq is counted.
+ *
+ * One line is printed:
+ *	label kind reader size_mb seconds mb_per_sec rows_ok errors
+ *
+ * The exit status is 1 if the rows did not match or an error occurred.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+
+#define ROW_WIDTH	1000
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+			"usage: %s [-d conninfo] [-k copy|select] [-s size_mb] [-r max_mb_per_sec] [-l label]\n",
+			progname);
+	exit(2);
+}
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Sleep as long as needed to keep the reading rate under the limit
+ */
+static void
+throttle(double bytes, double start, double rate)
+{
+	double		ahead;
+
+	if (rate <= 0)
+		return;
+
+	ahead = bytes / rate - (now_sec() - start);
+	if (ahead > 0)
+		usleep((useconds_t) (ahead * 1000000));
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *conninfo = "";
+	const char *label = "-";
+	const char *kind = "copy";
+	double		size_mb = 2048;
+	double		rate_mb = 0;
+	double		rate;
+	long long	nrows;
+	long long	rows = 0;
+	double		bytes = 0;
+	int			errors = 0;
+	char		query[256];
+	PGconn	   *conn;
+	PGresult   *res;
+	double		start;
+	double		elapsed;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:k:s:r:l:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				conninfo = optarg;
+				break;
+			case 'k':
+				kind = optarg;
+				break;
+			case 's':
+				size_mb = atof(optarg);
+				break;
+			case 'r':
+				rate_mb = atof(optarg);
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if ((strcmp(kind, "copy") != 0 && strcmp(kind, "select") != 0) || size_mb <= 0)
+		usage(argv[0]);
+
+	rate = rate_mb * 1024 * 1024;
+	nrows = (long long) (size_mb * 1024 * 1024 / ROW_WIDTH);
+
+	conn = PQconnectdb(conninfo);
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		fprintf(stderr, "%s", PQerrorMessage(conn));
+		return 1;
+	}
+
+	start = now_sec();
+
+	if (strcmp(kind, "copy") == 0)
+	{
+		char	   *buf;
+		int			len;
+
+		snprintf(query, sizeof(query),
+				 "COPY (SELECT i, repeat('x', %d) FROM generate_series(1, %lld) i) TO STDOUT",
+				 ROW_WIDTH - 16, nrows);
+		res = PQexec(conn, query);
+		if (PQresultStatus(res) != PGRES_COPY_OUT)
+		{
+			fprintf(stderr, "%s", PQerrorMessage(conn));
+			return 1;
+		}
+		PQclear(res);
+
+		while ((len = PQgetCopyData(conn, &buf, 0)) > 0)
+		{
+			rows++;
+			bytes += len;
+			PQfreemem(buf);
+			throttle(bytes, start, rate);
+		}
+		if (len == -2)
+			errors++;
+
+		while ((res = PQgetResult(conn)) != NULL)
+		{
+			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+				errors++;
+			PQclear(res);
+		}
+	}
+	else
+	{
+		snprintf(query, sizeof(query),
+				 "SELECT i, repeat('x', %d) FROM generate_series(1, %lld) i",
+				 ROW_WIDTH - 16, nrows);
+		if (!PQsendQuery(conn, query) || !PQsetSingleRowMode(conn))
+		{
+			fprintf(stderr, "%s", PQerrorMessage(conn));
+			return 1;
+		}
+
+		while ((res = PQgetResult(conn)) != NULL)
+		{
+			switch (PQresultStatus(res))
+			{
+				case PGRES_SINGLE_TUPLE:
+					rows++;
+					bytes += PQgetlength(res, 0, 0) + PQgetlength(res, 0, 1);
+					throttle(bytes, start, rate);
+					break;
+				case PGRES_TUPLES_OK:
+					break;
+				default:
+					errors++;
+					break;
+			}
+			PQclear(res);
+		}
+	}
+
+	elapsed = now_sec() - start;
+
+	if (errors > 0)
+		fprintf(stderr, "%s", PQerrorMessage(conn));
+
+	printf("%s %s %s %.0f %.2f %.1f %s %d\n",
+		   label, kind, rate > 0 ? "slow" : "fast", bytes / 1024 / 1024,
+		   elapsed, bytes / 1024 / 1024 / elapsed,
+		   rows == nrows ? "yes" : "no", errors);
+
+	PQfinish(conn);
+
+	return (rows == nrows && errors == 0) ? 0 : 1;
+}
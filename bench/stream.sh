@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+#
+# bench/stream.sh
+#
+# Measure throughput of large results sent to fast and slow readers while
+# pg_retire probes every second, on a temporary cluster, and check that
+# the probes never break the protocol stream. Exits with 1 if any run
+# received wrong rows or an error, so this can be used as a regression
+# gate.
+#
+# The following environment variables can be set:
+#   PG_CONFIG         pg_config of the server to use (default: pg_config)
+#   BENCH_PORT        port of the temporary cluster (default: 54329)
+#   BENCH_SIZE        MB streamed to the fast reader (default: 2048)
+#   BENCH_SLOW_SIZE   MB streamed to the slow reader (default: 256)
+#   BENCH_SLOW_RATE   MB/s read by the slow reader (default: 16)
+#   BENCH_INTERVAL    pg_retire.interval (default: 1)
+#
+
+set -euo pipefail
+
+BENCH_SIZE="${BENCH_SIZE:-2048}"
+BENCH_SLOW_SIZE="${BENCH_SLOW_SIZE:-256}"
+BENCH_SLOW_RATE="${BENCH_SLOW_RATE:-16}"
+BENCH_INTERVAL="${BENCH_INTERVAL:-1}"
+
+source "$(dirname "$0")/common.sh"
+
+STREAM="$(dirname "$0")/stream"
+
+start_cluster
+
+configs=("off|-c pg_retire.enable=off")
+for mode in write peek tcp_info; do
+  configs+=("$mode|-c pg_retire.enable=on -c pg_retire.interval=$BENCH_INTERVAL -c pg_retire.probe_mode=$mode")
+done
+
+echo "==> pg_retire.interval = ${BENCH_INTERVAL}s, slow reader at $BENCH_SLOW_RATE MB/s"
+printf "%-10s %-7s %-5s %8s %8s %9s %8s %7s\n" \
+  "config" "kind" "reader" "MB" "seconds" "MB/s" "delta" "errors"
+
+failed=0
+for kind in copy select; do
+  for reader in fast slow; do
+    if [[ "$reader" == "fast" ]]; then
+      opts=(-s "$BENCH_SIZE")
+    else
+      opts=(-s "$BENCH_SLOW_SIZE" -r "$BENCH_SLOW_RATE")
+    fi
+
+    base=""
+    for config in "${configs[@]}"; do
+      out="$(PGOPTIONS="${config#*|}" "$STREAM" -k "$kind" -l "${config%%|*}" "${opts[@]}")" || failed=1
+      read -r name k r mb secs rate rows_ok errors <<< "$out"
+      [[ -z "$base" ]] && base="$rate"
+      [[ "$rows_ok" == "yes" ]] || errors="$errors+rows"
+      awk -v n="$name" -v k="$k" -v r="$r" -v mb="$mb" -v s="$secs" \
+          -v t="$rate" -v b="$base" -v e="$errors" \
+        'BEGIN { printf "%-10s %-7s %-5s %8s %8s %9s %+7.2f%% %7s\n",
+                 n, k, r, mb, s, t, (t - b) * 100 / b, e }'
+    done
+  done
+done
+
+exit $failed
@@ -1,9 +1,9 @@
 #!/usr/bin/env bash
 
 TAG="__pg_retire_test__"
-export PGDATABASE=postgres
-export PGUSER=vagrant
-export PGHOST=192.168.33.14
+export PGDATABASE="${PGDATABASE:-postgres}"
+export PGUSER="${PGUSER:-$USER}"
+export PGHOST="${PGHOST:-localhost}"
 declare -a clients=()
 CLIENT_NUM=10
 
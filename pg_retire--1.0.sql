@@ -0,0 +1,74 @@
+/* contrib/pg_retire/pg_retire--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_retire" to load this file. \quit
+
+-- Counters of the current backend
+CREATE FUNCTION pg_retire_backend_counters(
+    OUT top_level_statements int8,
+    OUT nested_statements int8,
+    OUT timer_arms int8
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+-- Activity counters per role and database
+CREATE FUNCTION pg_retire_stats(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT probes int8,
+    OUT probe_failures int8,
+    OUT probe_eagain int8,
+    OUT cancels int8,
+    OUT alarms int8,
+    OUT terminations int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_retire_stats AS
+  SELECT userid, dbid,
+         sum(probes)::int8 AS probes,
+         sum(probe_failures)::int8 AS probe_failures,
+         sum(probe_eagain)::int8 AS probe_eagain,
+         sum(cancels)::int8 AS cancels,
+         sum(alarms)::int8 AS alarms,
+         sum(terminations)::int8 AS terminations
+    FROM pg_retire_stats()
+   GROUP BY userid, dbid;
+
+GRANT SELECT ON pg_retire_stats TO PUBLIC;
+
+-- Timing histograms
+CREATE FUNCTION pg_retire_histograms(
+    OUT histogram text,
+    OUT lower_bound int8,
+    OUT upper_bound int8,
+    OUT count int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Statements canceled because the client was down
+CREATE FUNCTION pg_retire_orphans(
+    OUT canceled_at timestamptz,
+    OUT pid int4,
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid int8,
+    OUT application_name text,
+    OUT elapsed_time float8,
+    OUT user_time float8,
+    OUT system_time float8,
+    OUT shared_blks_hit int8,
+    OUT shared_blks_read int8,
+    OUT local_blks_hit int8,
+    OUT local_blks_read int8,
+    OUT temp_bytes int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
@@ -17,21 +17,61 @@
 
 #include "postgres.h"
 
+#include <ctype.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef __linux__
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#endif
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
 
+#include "fmgr.h"
+#include "funcapi.h"
 #include "miscadmin.h"
+#include "pgstat.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/memutils.h"
 #include "libpq/auth.h"
 #include "libpq/libpq.h"
 #include "libpq/pqsignal.h"
 #include "libpq/pqformat.h"
 #include "utils/timeout.h"
 #include "utils/timestamp.h"
-#include "parser/analyze.h"
+#include "access/xact.h"
+#include "executor/executor.h"
+#include "port/pg_bitutils.h"
+#include "portability/instr_time.h"
+#include "postmaster/autovacuum.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "postmaster/postmaster.h"
+#include "replication/walsender.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lock.h"
+#include "storage/shmem.h"
+#include "tcop/cmdtag.h"
+#include "tcop/utility.h"
 #include "access/parallel.h"
 
+#include "pg_retire_probe.h"
+
 
 PG_MODULE_MAGIC;
 
@@ -40,8 +80,26 @@ PG_MODULE_MAGIC;
 #define TIMEOUT_INVALID()		(MyTimeoutId == MAX_TIMEOUTS)
 #define MILLISECONDS(sec)		(sec * 1000)
 
-/* Size that dummy packet can be stored */
-#define WBUFSIZE	128
+/* Same as PQ_SEND_BUFFER_SIZE in pqcomm.c */
+#define PGRETIRE_PQ_SEND_BUFFER_SIZE	8192
+
+/* Processes searched in /proc for the client of a loopback connection */
+#define PGRETIRE_MAX_PEER_SCAN		256
+
+/* Client processes are watched through pidfd_open(2), Linux 5.3 or later */
+#if defined(SYS_pidfd_open)
+#define USE_PIDFD
+#endif
+
+/* The epoll monitor needs pidfd_getfd(2), Linux 5.6 or later */
+#if defined(HAVE_SYS_EPOLL_H) && defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+#define USE_EPOLL_MONITOR
+#endif
+
+/* The sock_diag sweeper needs NETLINK_SOCK_DIAG */
+#if defined(__linux__) && defined(NETLINK_SOCK_DIAG)
+#define USE_SOCK_DIAG
+#endif
 
 /*
  * Do not schedule alarm in the interrupt pending.
@@ -53,26 +111,394 @@ do { \
 } while (0);
 
 /*
- * Data container for ParameterStatus message.
+ * How to check whether the client is alive.
+ */
+typedef enum
+{
+	PGRETIRE_PROBE_WRITE,		/* send a dummy ParameterStatus message */
+	PGRETIRE_PROBE_PEEK,		/* peek the socket, never send anything */
+	PGRETIRE_PROBE_TCP_INFO		/* read TCP state from the kernel */
+} PgRetireProbeMode;
+
+static const struct config_enum_entry probe_mode_options[] = {
+	{"write", PGRETIRE_PROBE_WRITE, false},
+	{"peek", PGRETIRE_PROBE_PEEK, false},
+	{"tcp_info", PGRETIRE_PROBE_TCP_INFO, false},
+	{NULL, 0, false}
+};
+
+/*
+ * State of the pg_retire timer.
+ *
+ * The timer goes from DISARMED to ARMED when a top-level statement starts
+ * executing, and back to DISARMED when it finishes or the transaction ends.
+ * With pg_retire.idle_in_transaction, it goes to IDLE when the backend
+ * reports that it is idle in a transaction block, and back to DISARMED when
+ * the transaction ends. The alarm handler reschedules the timer only while
+ * ARMED or IDLE, so no alarm fires while the session is idle otherwise.
+ */
+typedef enum
+{
+	PGRETIRE_ALARM_DISARMED,	/* no timer is scheduled */
+	PGRETIRE_ALARM_ARMED,		/* the timer is scheduled or being handled */
+	PGRETIRE_ALARM_IDLE			/* likewise, while idle in transaction */
+} PgRetireAlarmState;
+
+/*
+ * Which client processes are watched directly through a pidfd.
+ */
+typedef enum
+{
+	PGRETIRE_PEER_OFF,			/* none */
+	PGRETIRE_PEER_UNIX,			/* clients over Unix-domain sockets */
+	PGRETIRE_PEER_ALL			/* also clients over loopback TCP */
+} PgRetirePeerProcess;
+
+static const struct config_enum_entry peer_process_options[] = {
+	{"off", PGRETIRE_PEER_OFF, false},
+	{"unix", PGRETIRE_PEER_UNIX, false},
+	{"all", PGRETIRE_PEER_ALL, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Whether client sockets are watched by a background worker.
+ */
+typedef enum
+{
+	PGRETIRE_WORKER_OFF,		/* each backend watches its own client */
+	PGRETIRE_WORKER_EPOLL,		/* the worker waits for hangup with epoll */
+	PGRETIRE_WORKER_SOCK_DIAG	/* the worker dumps TCP state periodically */
+} PgRetireWorkerMode;
+
+static const struct config_enum_entry worker_mode_options[] = {
+	{"off", PGRETIRE_WORKER_OFF, false},
+	{"epoll", PGRETIRE_WORKER_EPOLL, false},
+	{"sock_diag", PGRETIRE_WORKER_SOCK_DIAG, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Registry entry of a backend that has been authenticated. Entries are
+ * indexed by BackendId - 1.
+ */
+typedef struct PgRetireSlot
+{
+	pg_atomic_uint32 pid;		/* owner backend, 0 if the slot is free */
+	pgsocket	sock;			/* client socket in the owner backend */
+	int			family;			/* address family of the client socket */
+	SockAddr	raddr;			/* address of the client */
+	uint64		inode;			/* inode number of the client socket */
+	pid_t		peer_pid;		/* client process if known, or 0 */
+	bool		probe_on_request;	/* true if SIGUSR2 makes it probe */
+	pg_atomic_uint32 watched;	/* true while the worker watches the socket */
+	pg_atomic_uint32 running;	/* true while the owner runs a top-level
+								 * statement */
+	pg_atomic_uint64 detected_at;	/* when the client was found down, in
+									 * microseconds, or 0 */
+} PgRetireSlot;
+
+/*
+ * Shared state of pg_retire.
  */
-typedef struct CharBuffer
+/*
+ * Activity counters, see pg_retire_stats().
+ */
+typedef enum PgRetireCounter
+{
+	PGRETIRE_COUNTER_PROBES,	/* checks of the client */
+	PGRETIRE_COUNTER_FAILURES,	/* checks that found the client down */
+	PGRETIRE_COUNTER_EAGAIN,	/* checks that would have blocked */
+	PGRETIRE_COUNTER_CANCELS,	/* cancellations issued */
+	PGRETIRE_COUNTER_ALARMS,	/* alarms fired */
+	PGRETIRE_COUNTER_TERMINATIONS,	/* sessions terminated */
+	PGRETIRE_NUM_COUNTERS
+} PgRetireCounter;
+
+/*
+ * Counters of a backend, indexed by MyBackendId - 1 like the registry.
+ * They are updated with atomics by the backend itself, also in the alarm
+ * handler, and by the monitor worker for cancellations it issues.
+ */
+typedef struct PgRetireBackendStats
+{
+	Oid			userid;			/* session user, InvalidOid until known */
+	Oid			dbid;			/* database */
+	pg_atomic_uint64 counters[PGRETIRE_NUM_COUNTERS];
+} PgRetireBackendStats;
+
+/* Padded to a cache line, so that backends never share one */
+typedef union PgRetireBackendStatsPadded
+{
+	PgRetireBackendStats stats;
+	char		pad[PG_CACHE_LINE_SIZE];
+} PgRetireBackendStatsPadded;
+
+/*
+ * Counters of exited backends, accumulated per role and database.
+ */
+typedef struct PgRetireStatsKey
+{
+	Oid			userid;
+	Oid			dbid;
+} PgRetireStatsKey;
+
+typedef struct PgRetireStatsEntry
+{
+	PgRetireStatsKey key;		/* hash key of entry - MUST BE FIRST */
+	uint64		counters[PGRETIRE_NUM_COUNTERS];
+} PgRetireStatsEntry;
+
+/*
+ * Log-bucket histograms of timings.
+ *
+ * Values below 4 have a bucket each. Above that, every power of two is
+ * split into 4 linear sub-buckets, so a bucket is at most 25% wide, like
+ * HdrHistogram with 2 significant bits. Values of 2^40 or more go to the
+ * last bucket.
+ */
+#define PGRETIRE_HIST_SUB_BITS		2
+#define PGRETIRE_HIST_SUB_BUCKETS	(1 << PGRETIRE_HIST_SUB_BITS)
+#define PGRETIRE_HIST_MAX_BITS		40
+#define PGRETIRE_HIST_BUCKETS \
+	((PGRETIRE_HIST_MAX_BITS - PGRETIRE_HIST_SUB_BITS + 1) * PGRETIRE_HIST_SUB_BUCKETS)
+
+typedef enum PgRetireHistogramId
+{
+	PGRETIRE_HIST_CANCEL_LATENCY,	/* client found down to the abort, in us */
+	PGRETIRE_HIST_PROBE_COST,	/* time spent in one check, in ns */
+	PGRETIRE_NUM_HISTOGRAMS
+} PgRetireHistogramId;
+
+static const char *const histogram_names[PGRETIRE_NUM_HISTOGRAMS] = {
+	"cancel_latency_us",
+	"probe_cost_ns"
+};
+
+typedef struct PgRetireHistogram
+{
+	pg_atomic_uint64 buckets[PGRETIRE_HIST_BUCKETS];
+} PgRetireHistogram;
+
+/*
+ * What a statement canceled because the client was down had consumed.
+ */
+typedef struct PgRetireOrphan
+{
+	TimestampTz canceled_at;	/* when the transaction aborted */
+	int			pid;			/* backend */
+	Oid			userid;			/* session user */
+	Oid			dbid;			/* database */
+	uint64		queryid;		/* query identifier, 0 if not computed */
+	char		application_name[NAMEDATALEN];
+	int64		elapsed;		/* since the statement started, in us */
+	bool		has_usage;		/* the following are valid */
+	int64		user_time;		/* user CPU time, in us */
+	int64		system_time;	/* system CPU time, in us */
+	int64		shared_blks_hit;
+	int64		shared_blks_read;
+	int64		local_blks_hit;
+	int64		local_blks_read;
+	int64		temp_blks_written;
+} PgRetireOrphan;
+
+/*
+ * Ring of the last pg_retire.max_orphan_records canceled statements.
+ */
+typedef struct PgRetireOrphanRing
+{
+	uint64		nrecords;		/* records ever added */
+	PgRetireOrphan records[FLEXIBLE_ARRAY_MEMBER];
+} PgRetireOrphanRing;
+
+typedef struct PgRetireSharedState
 {
-	char 	buf[WBUFSIZE];	/* Fixed buffer size */
-	int 	pos;			/* Next writing position in buf */
-} CharBuffer;
+	LWLock	   *lock;			/* protects the stats hashtable and the
+								 * orphan ring */
+	PgRetireHistogram histograms[PGRETIRE_NUM_HISTOGRAMS];
+	Latch	   *worker_latch;	/* latch of the monitor worker, or NULL */
+	pid_t		worker_pid;		/* pid of the monitor worker, or 0 */
+	int			nslots;			/* number of entries in slots */
+	PgRetireSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} PgRetireSharedState;
 
 /*----- GUC variables -----*/
 
 /* If true, pg_retire is enabled */
 static bool pg_retire_enable;
+/* If true, sessions idle in transaction are watched too */
+static bool pg_retire_idle_in_transaction;
 /* Interval seconds to do sanity check of client */
 static int pg_retire_interval;	/* seconds */
+/* Probe strategy used in sanity check */
+static int pg_retire_probe_mode = PGRETIRE_PROBE_WRITE;
+/* Background worker that watches client sockets of all backends */
+static int pg_retire_worker_mode = PGRETIRE_WORKER_OFF;
+/* Retransmissions after which the client is regarded as down */
+static int pg_retire_max_retransmits;
+/* Capacity of the ring of canceled statements */
+static int pg_retire_max_orphan_records;
+/* TCP options applied while a statement is watched, 0 means unchanged */
+static int pg_retire_tcp_user_timeout;	/* milliseconds */
+static int pg_retire_keepalives_idle;	/* seconds */
+static int pg_retire_keepalives_interval;	/* seconds */
+static int pg_retire_keepalives_count;
+/* Client processes watched through a pidfd */
+static int pg_retire_peer_process = PGRETIRE_PEER_OFF;
+/* Interval of the worker to probe root blockers of the lock wait graph */
+static int pg_retire_blocker_interval;	/* milliseconds */
+/* If true, a client found down makes the others from its host probed */
+static bool pg_retire_probe_same_host;
+/* Time without the client reading, after which the session is terminated */
+static int pg_retire_stall_timeout;	/* seconds */
+/* Utility commands watched like executor statements */
+static char *pg_retire_utility_commands = NULL;
 
 /*---- Local variables ----*/
 
 /* Saved hook values in case of unload */
 static ClientAuthentication_hook_type prev_ClientAuthentication = NULL;
-static post_parse_analyze_hook_type prev_post_parse_analyze = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static emit_log_hook_type prev_emit_log_hook = NULL;
+
+/* Links to shared memory state */
+static PgRetireSharedState *pgrt_shared = NULL;
+static PgRetireBackendStatsPadded *pgrt_backend_stats = NULL;
+static HTAB *pgrt_stats_hash = NULL;
+static PgRetireOrphanRing *pgrt_orphans = NULL;
+
+/* My registry entry, NULL until client authentication completes */
+static PgRetireSlot *MySlot = NULL;
+static PgRetireBackendStats *MyStats = NULL;
+
+/* Client process on the same host, and a pidfd referring to it */
+static pid_t peer_pid = 0;
+static int peer_pidfd = -1;
+
+/* Current nesting depth of executor calls and watched utility commands */
+static int exec_nesting_level = 0;
+
+/*
+ * State of the utility command running at top level. The timer is armed
+ * for it once, when it starts if it is in pg_retire.utility_commands, or
+ * else when it first calls the executor.
+ */
+static bool in_utility = false;			/* a utility command runs */
+static bool utility_entered = false;	/* the timer has been armed for it */
+static uint64 utility_query_id = 0;		/* its query identifier */
+
+/*
+ * The top-level query the timer is armed for. ExecutorFinish of the same
+ * query, and ExecutorRun of it again, do not arm it once more. Reset when
+ * the timer is disarmed.
+ */
+static QueryDesc *armed_query = NULL;
+
+/*
+ * Command tags in pg_retire.utility_commands, indexed by CommandTag. Built
+ * by the check hook of the parameter.
+ */
+static bool *watched_utility_commands = NULL;
+
+/* State of my timer, also read in the alarm handler */
+static volatile sig_atomic_t alarm_state = PGRETIRE_ALARM_DISARMED;
+
+/* True while MySlot->running is set */
+static bool slot_running = false;
+
+/* Set in the alarm handler when the client is found down */
+static volatile sig_atomic_t cancel_requested = false;
+
+/* Set in the alarm handler when the session is terminated for a stall */
+static volatile sig_atomic_t stall_terminated = false;
+
+/* True while the alarm handler runs */
+static volatile sig_atomic_t in_alarm_handler = false;
+
+/*
+ * Output state of libpq, tracked by wrapping PqCommMethods. These are read
+ * in the alarm handler.
+ */
+static PQcommMethods *prev_PqCommMethods = NULL;
+static PQcommMethods pgrt_PqCommMethods;
+
+static volatile sig_atomic_t pq_busy = false;	/* in a libpq output call */
+static volatile sig_atomic_t pq_copy_out = false;	/* in COPY OUT */
+static volatile sig_atomic_t pq_flushed = false;	/* flushed data since the last check */
+static volatile sig_atomic_t probe_deferred = false;	/* probe waits for a message boundary */
+static volatile uint32 pq_sent_bytes = 0;	/* bytes passed to putmessage */
+
+/*
+ * Rest of a dummy message that the socket did not take in the alarm
+ * handler. It is sent before any other output, see put_probe_rest().
+ */
+static CharBuffer probe_rest;
+static uint32 pq_sent_bytes_at_check = 0;	/* pq_sent_bytes at the last check */
+
+/* tcpi_bytes_acked of the client socket at the last check */
+static uint64 last_bytes_acked = 0;
+
+/*
+ * Progress of the client in reading the output, see reader_stalled(). Only
+ * used in the alarm handler.
+ */
+static uint64 stall_since = 0;	/* when progress was last seen, in
+								 * microseconds, or 0 */
+static int stall_outq = 0;		/* send queue of the socket at the last check */
+static uint32 stall_sent_bytes = 0;	/* pq_sent_bytes at the last check */
+
+/*
+ * TCP options of the client socket that are tightened while a statement is
+ * watched, so that the kernel detects a dead peer within seconds.
+ */
+typedef struct TcpSockopt
+{
+	int			optname;		/* option at level IPPROTO_TCP */
+	int		   *value;			/* GUC variable, 0 means unchanged */
+	int			saved;			/* session value to be restored */
+	bool		changed;		/* true while tightened */
+} TcpSockopt;
+
+static TcpSockopt tcp_sockopts[] = {
+#ifdef TCP_USER_TIMEOUT
+	{TCP_USER_TIMEOUT, &pg_retire_tcp_user_timeout, 0, false},
+#endif
+#ifdef TCP_KEEPIDLE
+	{TCP_KEEPIDLE, &pg_retire_keepalives_idle, 0, false},
+#endif
+#ifdef TCP_KEEPINTVL
+	{TCP_KEEPINTVL, &pg_retire_keepalives_interval, 0, false},
+#endif
+#ifdef TCP_KEEPCNT
+	{TCP_KEEPCNT, &pg_retire_keepalives_count, 0, false},
+#endif
+};
+
+/* True while any of tcp_sockopts is tightened */
+static volatile sig_atomic_t sockopts_tightened = false;
+
+/*
+ * Counters of this backend, see pg_retire_backend_counters().
+ */
+static uint64 top_level_statements = 0;	/* statements watched at top level */
+static uint64 nested_statements = 0;	/* executor calls nested in them */
+static uint64 timer_arms = 0;			/* times the timer was enabled */
+
+/*
+ * Resource usage when the current top-level statement started, to which
+ * that at the cancel is compared.
+ */
+static struct
+{
+	TimestampTz stmt_start;		/* statement start timestamp, or 0 */
+	uint64		queryid;
+	BufferUsage bufusage;
+	struct rusage rusage;
+} orphan_baseline;
 
 /*
  * TimeoutId used by pg_retire. TimeoutId never exceeds MAX_TIMEOUTS.
@@ -84,15 +510,81 @@ static TimeoutId MyTimeoutId = MAX_TIMEOUTS;
 void _PG_init(void);
 void _PG_fini(void);
 
+PG_FUNCTION_INFO_V1(pg_retire_backend_counters);
+PG_FUNCTION_INFO_V1(pg_retire_stats);
+PG_FUNCTION_INFO_V1(pg_retire_histograms);
+PG_FUNCTION_INFO_V1(pg_retire_orphans);
+PGDLLEXPORT void pg_retire_worker_main(Datum main_arg) pg_attribute_noreturn();
+
 static void pg_retire_ClientAuthentication(Port *port, int status);
-static void pg_retire_post_parse_analyze(ParseState *pstate, Query *query);
+static void pg_retire_ExecutorRun(QueryDesc *queryDesc,
+								  ScanDirection direction,
+								  uint64 count, bool execute_once);
+static void pg_retire_ExecutorFinish(QueryDesc *queryDesc);
+static void pg_retire_ExecutorEnd(QueryDesc *queryDesc);
+static void pg_retire_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+									 ProcessUtilityContext context,
+									 ParamListInfo params,
+									 QueryEnvironment *queryEnv,
+									 DestReceiver *dest, QueryCompletion *qc);
+static bool check_utility_commands(char **newval, void **extra, GucSource source);
+static void assign_utility_commands(const char *newval, void *extra);
+static void pg_retire_xact_callback(XactEvent event, void *arg);
+static void pg_retire_emit_log(ErrorData *edata);
+static void enterExecutor(QueryDesc *queryDesc);
+static void enterTopLevelStatement(uint64 queryId);
+static void armAlarm(void);
+static void armIdleAlarm(void);
+static void disarmAlarm(void);
 static void pg_retire_alarm_handler(void);
+static void handle_alarm(void);
+static void pg_retire_probe_request_handler(SIGNAL_ARGS);
 static bool maybeScheduleAlarm(void);
-static bool doSanityCheck(void);
+static bool doSanityCheck(bool requested);
 static void cancelTransaction(void);
+static void terminateSession(void);
+static void terminateStalledSession(void);
+static bool reader_stalled(void);
 static int send_dummy_message_to_frontend(void);
-static int write_cbuf(CharBuffer *pb, void *buf, size_t len);
-static int flush_cbuf(CharBuffer *pb, Port *port);
+static void install_pq_methods(void);
+static bool pq_made_progress(void);
+static bool pq_at_message_boundary(void);
+static void put_deferred_probe(void);
+static void put_probe_rest(void);
+static void tighten_tcp_sockopts(void);
+static void restore_tcp_sockopts(void);
+static int pgrt_max_backends(void);
+static Size pgrt_memsize(void);
+static void pgrt_shmem_startup(void);
+static void register_slot(Port *port);
+static void unregister_slot(int code, Datum arg);
+static bool socket_is_watched(void);
+static void count_event(PgRetireBackendStats *stats, PgRetireCounter counter);
+static void fold_backend_stats(PgRetireBackendStats *stats);
+static uint64 now_microsec(void);
+static void mark_client_down(PgRetireSlot *slot);
+static void probe_same_host(PgRetireSlot *down);
+static void record_timing(PgRetireHistogramId id, uint64 value);
+static void take_orphan_baseline(uint64 queryId);
+static void record_orphan(void);
+static void resolve_peer_process(Port *port);
+static bool peer_process_exited(void);
+static void signal_backend(pid_t pid, int sig);
+#ifdef USE_EPOLL_MONITOR
+static void epoll_monitor_loop(void);
+#endif
+#ifdef USE_SOCK_DIAG
+typedef void (*sock_diag_callback) (const struct inet_diag_msg *msg,
+									const struct tcp_info *info,
+									Size infolen, void *arg);
+static int sock_diag_dump(int family, uint16 sport, uint16 dport,
+						  sock_diag_callback callback, void *arg);
+static void sock_diag_monitor_loop(void);
+#endif
+static void worker_shmem_exit(int code, Datum arg);
+static void blocker_monitor_loop(void);
+static long maybe_probe_blockers(TimestampTz *next_check);
+static void probe_root_blockers(void);
 
 /*
  * pg_retire_ClientAuthentication: ClientAuthentication_hook
@@ -122,330 +614,3104 @@ pg_retire_ClientAuthentication(Port *port, int status)
 		if (TIMEOUT_INVALID())
 		{
 			MyTimeoutId = RegisterTimeout(USER_TIMEOUT, pg_retire_alarm_handler);
+			RegisterXactCallback(pg_retire_xact_callback, NULL);
+
+			/*
+			 * SIGUSR2 is ignored by normal backends. A walsender uses it
+			 * for itself.
+			 */
+			if (!am_walsender)
+			{
+				struct sigaction act;
+
+				act.sa_handler = pg_retire_probe_request_handler;
+				sigemptyset(&act.sa_mask);
+				sigaddset(&act.sa_mask, SIGALRM);
+				act.sa_flags = SA_RESTART;
+				(void) sigaction(SIGUSR2, &act, NULL);
+			}
 
 			ereport(DEBUG3,
 					(errmsg("registered pg_retire timer: id %d", MyTimeoutId)));
 		}
+
+		/*
+		 * Track output of libpq, so that probes never interleave with it.
+		 */
+		if (prev_PqCommMethods == NULL)
+			install_pq_methods();
+
+		/*
+		 * Find the client process if it runs on this host.
+		 */
+		if (peer_pidfd < 0)
+			resolve_peer_process(port);
+
+		/*
+		 * Let the monitor worker know my client socket.
+		 */
+		if (pgrt_shared && MySlot == NULL)
+			register_slot(port);
 	}
 
 }
 
 /*
- * pg_retire_post_parse_analyze: post_parse_analyze_hook
- *		Enable a timer for sanity check.
+ * pg_retire_ExecutorRun: ExecutorRun_hook
+ *		Enable a timer for sanity check while the executor runs.
  *
- * May be appropriate to enable a timer after reading command.
+ * Arming here, not after parse analysis, covers every way a plan gets
+ * executed: simple queries, Bind/Execute of prepared statements, cached
+ * plans, EXECUTE and FETCH. The timer stays armed through ExecutorFinish of
+ * the same query, and is disabled in ExecutorEnd, or at ReadyForQuery for a
+ * portal left suspended, so it never fires while the session is idle.
  */
 static void
-pg_retire_post_parse_analyze(ParseState *pstate, Query *query)
+pg_retire_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+					  uint64 count, bool execute_once)
 {
-	if (prev_post_parse_analyze)
-		prev_post_parse_analyze(pstate, query);
-
-	if (TIMEOUT_INVALID() || !pg_retire_enable)
-		return;
-
-	RETURN_IF_INTERRUPT_PENDING;
+	enterExecutor(queryDesc);
 
-	/*
-	 * Skip utility statement.
-	 */
-	if (query->commandType == CMD_UTILITY)
-		return;
-
-	if (maybeScheduleAlarm())
-		ereport(DEBUG3,
-				(errmsg("scheduled pg_retire alarm after %d seconds again",
-						pg_retire_interval)));
+	exec_nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+		exec_nesting_level--;
+	}
+	PG_CATCH();
+	{
+		exec_nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 }
 
 /*
- * pg_retire_alarm_handler
- *		Called from SIGALRM signal handler.
+ * pg_retire_ExecutorFinish: ExecutorFinish_hook
+ *		Enable a timer while AFTER triggers are fired.
  *
- * In the alarm handler, do sanity check of the client and cancel current
- * transaction if the client is down.
+ * After ExecutorRun of the same query, the timer is still armed.
  */
 static void
-pg_retire_alarm_handler(void)
+pg_retire_ExecutorFinish(QueryDesc *queryDesc)
 {
-	int save_errno = errno;
-
-	/*
-	 * If query has been already canceled or the backend is terminating,
-	 * do not do sanity check.
-	 */
-	RETURN_IF_INTERRUPT_PENDING;
-
-	PG_SETMASK(&BlockSig);
+	enterExecutor(queryDesc);
 
-	if (doSanityCheck())
+	exec_nesting_level++;
+	PG_TRY();
 	{
-		/*
-		 * If current transaction is still running, reschedule alarm.
-		 * Because sanity check may be needed more than one time.
-		 */
-		if (maybeScheduleAlarm())
-			ereport(DEBUG3,
-					(errmsg("rescheduled pg_retire alarm after %d seconds again",
-							pg_retire_interval)));
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+		exec_nesting_level--;
 	}
-	else
+	PG_CATCH();
 	{
-		/*
-		 * Failed to write dummy parameter status. The client may be down,
-		 * so cancel current transaction here.
-		 * In the sanity check, InterruptPending and ClientConnectionLost flags
-		 * may be already set. But we send a signal considering the case where
-		 * the backend is waiting for process latch. When the backend receives
-		 * SIGINT, it will call StatementCancelHandler.
-		 */
-		cancelTransaction();
+		exec_nesting_level--;
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+}
 
-	PG_SETMASK(&UnBlockSig);
+/*
+ * pg_retire_ExecutorEnd: ExecutorEnd_hook
+ *		Disable the timer when the top-level query finishes.
+ */
+static void
+pg_retire_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
 
-	errno = save_errno;
+	if (exec_nesting_level == 0)
+		disarmAlarm();
 }
 
 /*
- * maybeScheduleAlarm
- *		Schedule alarm if necessary.
+ * pg_retire_ProcessUtility: ProcessUtility_hook
+ *		Enable a timer once while a utility command runs at top level.
  *
- * If the registered time had been fired, reschedule alarm. Normally,
- * after backend send the result of a query to client, it exits. But
- * client that disconnects logically, like which has a feature of
- * connection pooling, keeps current connection. Therefore, we must
- * compare current time with firing time before reschedule alarm.
+ * Every utility command at top level counts as a nesting level, so that
+ * the executor calls it makes, such as the statements of a DO block, are
+ * nested in it and do not arm and disarm the timer one by one. Commands in
+ * pg_retire.utility_commands, such as CREATE INDEX or VACUUM, do their work
+ * outside the executor hooks, so the timer is armed when they start. For
+ * the others, it is armed when they first call the executor, if ever.
+ * Some commands commit transactions of their own, so the timer is kept
+ * armed across them until the command returns.
  */
-static bool
-maybeScheduleAlarm(void)
+static void
+pg_retire_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+						 ProcessUtilityContext context, ParamListInfo params,
+						 QueryEnvironment *queryEnv, DestReceiver *dest,
+						 QueryCompletion *qc)
 {
-	bool timer_fired;
-	TimestampTz now;
-	TimestampTz fin_time;
-
-	/*
-	 * Timeout disabled.
-	 */
-	if (TIMEOUT_INVALID())
-		return false;
-
-	timer_fired = get_timeout_indicator(MyTimeoutId, false);
-
-	/*
-	 * Reschedule if previous timer had been fired.
-	 */
-	if (timer_fired)
+	if (exec_nesting_level > 0)
 	{
-		enable_timeout_after(MyTimeoutId, MILLISECONDS(pg_retire_interval));
-		return true;
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString, context, params,
+								queryEnv, dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, context, params,
+									queryEnv, dest, qc);
+		return;
 	}
 
-	now = GetCurrentTimestamp();
-	fin_time = get_timeout_finish_time(MyTimeoutId);
-
-	/*
-	 * Alarm may be already scheduled.
-	 */
-	if (fin_time != 0 && now < fin_time)
-		return false;
+	utility_query_id = pstmt->queryId;
+	utility_entered = false;
+	if (pg_retire_enable && watched_utility_commands != NULL &&
+		watched_utility_commands[CreateCommandTag(pstmt->utilityStmt)])
+	{
+		utility_entered = true;
+		enterTopLevelStatement(utility_query_id);
+	}
 
-	enable_timeout_after(MyTimeoutId, MILLISECONDS(pg_retire_interval));
+	exec_nesting_level++;
+	in_utility = true;
+	PG_TRY();
+	{
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString, context, params,
+								queryEnv, dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, context, params,
+									queryEnv, dest, qc);
+		exec_nesting_level--;
+		in_utility = false;
+	}
+	PG_CATCH();
+	{
+		exec_nesting_level--;
+		in_utility = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-	return true;
+	if (utility_entered)
+		disarmAlarm();
 }
 
 /*
- * pgrt_doSanityCheck
- *		Do sanity check of the client.
+ * check_utility_commands: check hook for pg_retire.utility_commands
+ *		Translate the comma-separated list of command tags into a lookup
+ *		table indexed by CommandTag.
  *
- * Check if the client is alive by writing a dummy parameter to the
- * accepted socket descriptor. If the client has been already down,
- * write will fail. We may not be able to notice in the first write,
- * because system does not deny to write the half-closed socket.
- * In such a case, we will notice client down in the second write.
+ * Tags are matched case-insensitively and may contain spaces, e.g.
+ * 'CREATE INDEX, VACUUM'.
  */
 static bool
-doSanityCheck(void)
+check_utility_commands(char **newval, void **extra, GucSource source)
 {
-	int status;
-
-	/*
-	 * Send a dummy parameter status report to the client.
-	 */
-	status = send_dummy_message_to_frontend();
+	bool	   *watched;
+	char	   *rawstring;
+	char	   *tok;
+	char	   *saveptr;
 
-	if (status != 0)
+	watched = (bool *) guc_malloc(LOG, sizeof(bool) * COMMAND_TAG_NEXTTAG);
+	if (watched == NULL)
 		return false;
+	memset(watched, 0, sizeof(bool) * COMMAND_TAG_NEXTTAG);
+
+	rawstring = pstrdup(*newval);
+	for (tok = strtok_r(rawstring, ",", &saveptr); tok != NULL;
+		 tok = strtok_r(NULL, ",", &saveptr))
+	{
+		char	   *end;
+		CommandTag	tag;
+
+		while (isspace((unsigned char) *tok))
+			tok++;
+		end = tok + strlen(tok);
+		while (end > tok && isspace((unsigned char) end[-1]))
+			*--end = '\0';
+		if (*tok == '\0')
+			continue;
+
+		tag = GetCommandTagEnum(tok);
+		if (tag == CMDTAG_UNKNOWN)
+		{
+			GUC_check_errdetail("Unrecognized command tag: \"%s\".", tok);
+			pfree(rawstring);
+			free(watched);
+			return false;
+		}
+		watched[tag] = true;
+	}
+	pfree(rawstring);
 
+	*extra = watched;
 	return true;
 }
 
 /*
- * cancelTransaction
- *		Cancel current transaction.
- *
- * Send a SIGINT to itself.
+ * assign_utility_commands: assign hook for pg_retire.utility_commands
  */
 static void
-cancelTransaction(void)
+assign_utility_commands(const char *newval, void *extra)
 {
-	int sig = SIGINT;
-
-#ifdef HAVE_SETSID
-	/* Try to signal whole process group */
-	kill(-MyProcPid, sig);
-#endif
-	kill(MyProcPid, sig);
+	watched_utility_commands = (bool *) extra;
 }
 
 /*
- * send_dummy_message_to_frontend
- *		Send dummy parameter status to client.
+ * pg_retire_xact_callback
+ *		Disable the timer at the end of transaction.
  *
- * To check whether the client is still alive, send a unreserved dummy parameter
- * to the client. Normally, client receives it and ignores.
+ * On error, PostgresMain() has already disabled all timeouts before the
+ * transaction is aborted. Going back to DISARMED here keeps the state in
+ * sync with timeout.c.
  */
-static int
-send_dummy_message_to_frontend(void)
+static void
+pg_retire_xact_callback(XactEvent event, void *arg)
 {
-	/*
-	 * Dummy parameter name and value that pg_retire sends to client at the
-	 * time of client check.
-	 */
-#define PGRETIRE_DUMMY_PAREMETER_NAME	"pg_retire_dummy_name"
-#define PGRETIRE_DUMMY_PAREMETER_VALUE	"pg_retire_dummy_value"
-#define PGRETIRE_KEEP_ALIVE_MESSAGE		"keep alive checking from pg_retire"
-
-	CharBuffer cb;
-	int r;
-	int plen;
-
-	cb.pos = 0;
-
-	if (PG_PROTOCOL_MAJOR(MyProcPort->proto) >= 3)
-	{
-		/*
-		 * Protocol version 3 or later supports ParameterStatus message.
-		 * It starts with 'S', for more detail, see the latest public document.
-		 */
-		write_cbuf(&cb, "S", 1);
-		plen = sizeof(PGRETIRE_DUMMY_PAREMETER_NAME) + sizeof(PGRETIRE_DUMMY_PAREMETER_VALUE) + sizeof(plen);
-		plen = htonl(plen);
-		write_cbuf(&cb, &plen, sizeof(plen));
-		write_cbuf(&cb, PGRETIRE_DUMMY_PAREMETER_NAME, sizeof(PGRETIRE_DUMMY_PAREMETER_NAME));
-		write_cbuf(&cb, PGRETIRE_DUMMY_PAREMETER_VALUE, sizeof(PGRETIRE_DUMMY_PAREMETER_VALUE));
-	}
-	else
+	switch (event)
 	{
-		/*
-		 * Send a message with V2 protocol.
-		 * See the following link about old protocol.
-		 * http://dorn.org/docs/postgres/postgres/protocol21288.htm
-		 */
-		write_cbuf(&cb, "N", 1);
-		write_cbuf(&cb, PGRETIRE_KEEP_ALIVE_MESSAGE, sizeof(PGRETIRE_KEEP_ALIVE_MESSAGE));
-	}
-
-	r = flush_cbuf(&cb, MyProcPort);
+		case XACT_EVENT_ABORT:
+			if (cancel_requested)
+			{
+				cancel_requested = false;
+				ereport(DEBUG3,
+						(errmsg("pg_retire canceled the statement because the client is down")));
+			}
 
-	return r;
+			/*
+			 * The client was found down by me or by the monitor worker, and
+			 * the cancel has taken effect now.
+			 */
+			if (MySlot != NULL)
+			{
+				uint64 detected_at = pg_atomic_exchange_u64(&MySlot->detected_at, 0);
+
+				if (detected_at != 0)
+				{
+					record_timing(PGRETIRE_HIST_CANCEL_LATENCY,
+								  now_microsec() - detected_at);
+					record_orphan();
+				}
+			}
+			/* A utility command with the timer armed may roll back and go on */
+			if (!in_utility || !utility_entered)
+				disarmAlarm();
+			break;
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PREPARE:
+			/* The statement finished before the cancel took effect */
+			if (MySlot != NULL)
+				pg_atomic_write_u64(&MySlot->detected_at, 0);
+			if (!in_utility || !utility_entered)
+				disarmAlarm();
+			break;
+		default:
+			break;
+	}
 }
 
 /*
- * write_cbuf
+ * pg_retire_emit_log: emit_log_hook
+ *		Log why pg_retire terminated the session.
+ *
+ * ProcDiePending is reported as "terminating connection due to
+ * administrator command". Before that FATAL message reaches the server log,
+ * log the real reason.
  */
-static int
-write_cbuf(CharBuffer *cb, void *buf, size_t len)
+static void
+pg_retire_emit_log(ErrorData *edata)
 {
-	char *src = buf;
-	char *dst = cb->buf + cb->pos;
-	int i = 0;
-	if (cb->pos + len <= WBUFSIZE)
+	if (stall_terminated && edata->elevel == FATAL)
 	{
-		while (i++ < len)
-			*dst++ = *src++;
-
-		cb->pos += len;
-		return len;
+		stall_terminated = false;
+		ereport(LOG,
+				(errmsg("pg_retire terminated the session because the client has read nothing for %d seconds",
+						pg_retire_stall_timeout)));
 	}
-	return -1;
+
+	if (prev_emit_log_hook)
+		prev_emit_log_hook(edata);
 }
 
 /*
- * flush_cbuf
+ * enterExecutor
+ *		Arm the timer once per top-level statement.
+ *
+ * Statements run through SPI, e.g. in a PL/pgSQL loop, are nested in the
+ * top-level one, which already armed the timer. They only bump a counter.
+ * The first statement run by a utility command arms the timer for it,
+ * unless that has been done when it started. ExecutorFinish, or ExecutorRun
+ * of a portal fetched again, is the same statement as the call that armed
+ * the timer.
+ */
+static void
+enterExecutor(QueryDesc *queryDesc)
+{
+	if (exec_nesting_level > 0)
+	{
+		nested_statements++;
+		if (in_utility && !utility_entered)
+		{
+			utility_entered = true;
+			enterTopLevelStatement(utility_query_id);
+		}
+		return;
+	}
+
+	if (queryDesc == armed_query)
+		return;
+
+	armed_query = queryDesc;
+	enterTopLevelStatement(queryDesc->plannedstmt->queryId);
+}
+
+/*
+ * enterTopLevelStatement
+ *		Arm the timer for a top-level executor call or utility command.
+ */
+static void
+enterTopLevelStatement(uint64 queryId)
+{
+	top_level_statements++;
+
+	/* The role and the database are not known yet at authentication */
+	if (MyStats != NULL && MyStats->userid == InvalidOid)
+	{
+		MyStats->dbid = MyDatabaseId;
+		MyStats->userid = GetSessionUserId();
+	}
+
+	/*
+	 * The monitor worker only cancels a backend running a statement, and
+	 * not one that has disabled pg_retire for the session.
+	 */
+	if (MySlot != NULL && !slot_running && pg_retire_enable)
+	{
+		pg_atomic_write_u32(&MySlot->running, 1);
+		slot_running = true;
+	}
+
+	take_orphan_baseline(queryId);
+	armAlarm();
+}
+
+/*
+ * armAlarm
+ *		Enable a timer for sanity check.
+ *
+ * Nothing is done while the timer is already armed, so this costs no more
+ * than a flag test in that case.
+ */
+static void
+armAlarm(void)
+{
+	if (alarm_state == PGRETIRE_ALARM_ARMED)
+		return;
+
+	/*
+	 * The timer already runs since the session became idle in transaction,
+	 * and goes on for this statement.
+	 */
+	if (alarm_state == PGRETIRE_ALARM_IDLE)
+	{
+		alarm_state = PGRETIRE_ALARM_ARMED;
+		stall_since = 0;
+		return;
+	}
+
+	if (TIMEOUT_INVALID() || !pg_retire_enable)
+		return;
+
+	RETURN_IF_INTERRUPT_PENDING;
+
+	/*
+	 * The timer is armed even when the monitor worker watches my client.
+	 * Its first alarm tightens the TCP options, without which the kernel
+	 * never reports a vanished host to the worker during a silent
+	 * statement, see handle_alarm().
+	 */
+
+	/* Output before this statement proves nothing */
+	pq_flushed = false;
+	pq_sent_bytes_at_check = pq_sent_bytes;
+	last_bytes_acked = 0;
+	stall_since = 0;
+
+	alarm_state = PGRETIRE_ALARM_ARMED;
+	enable_timeout_after(MyTimeoutId, MILLISECONDS(pg_retire_interval));
+	timer_arms++;
+
+	ereport(DEBUG3,
+			(errmsg("scheduled pg_retire alarm after %d seconds",
+					pg_retire_interval)));
+}
+
+/*
+ * armIdleAlarm
+ *		Enable a timer while the session is idle in transaction.
+ *
+ * Called when ReadyForQuery reports a transaction block in progress. The
+ * backend then sleeps in recv() on the socket, which never returns for a
+ * half-open client, while the transaction keeps its locks. The client is
+ * probed as during a statement, with the TCP options tightened, and the
+ * session is terminated if the client is down.
+ *
+ * This is also done when the monitor worker watches the client socket,
+ * because the worker only notices a client that has closed the connection,
+ * and the backend notices that by itself while idle.
+ */
+static void
+armIdleAlarm(void)
+{
+	if (alarm_state != PGRETIRE_ALARM_DISARMED)
+		return;
+
+	if (TIMEOUT_INVALID() || !pg_retire_enable ||
+		!pg_retire_idle_in_transaction)
+		return;
+
+	RETURN_IF_INTERRUPT_PENDING;
+
+	pq_flushed = false;
+	pq_sent_bytes_at_check = pq_sent_bytes;
+	last_bytes_acked = 0;
+
+	alarm_state = PGRETIRE_ALARM_IDLE;
+	enable_timeout_after(MyTimeoutId, MILLISECONDS(pg_retire_interval));
+	timer_arms++;
+}
+
+/*
+ * disarmAlarm
+ *		Disable the timer for sanity check.
+ *
+ * The state is changed first, so that the alarm handler never reschedules
+ * the timer being disabled.
+ */
+static void
+disarmAlarm(void)
+{
+	if (slot_running)
+	{
+		pg_atomic_write_u32(&MySlot->running, 0);
+		slot_running = false;
+	}
+
+	armed_query = NULL;
+
+	if (alarm_state == PGRETIRE_ALARM_DISARMED)
+		return;
+
+	alarm_state = PGRETIRE_ALARM_DISARMED;
+	disable_timeout(MyTimeoutId, false);
+
+	if (sockopts_tightened)
+		restore_tcp_sockopts();
+}
+
+/*
+ * pg_retire_alarm_handler
+ *		Called from SIGALRM signal handler.
+ *
+ * In the alarm handler, do sanity check of the client and cancel current
+ * transaction if the client is down.
+ *
+ * Everything done here must be async-signal-safe. The probe is one or two
+ * plain syscalls on the socket, and the cancel only sets interrupt flags
+ * and the process latch, which are handled at the next CHECK_FOR_INTERRUPTS.
+ * timeout.c already holds interrupts and SIGALRM while handlers run, so no
+ * signal mask is changed here. Anything that may log is deferred to the
+ * transaction callback.
+ */
+static void
+pg_retire_alarm_handler(void)
+{
+	int save_errno = errno;
+
+	in_alarm_handler = true;
+	handle_alarm();
+	in_alarm_handler = false;
+
+	errno = save_errno;
+}
+
+/*
+ * handle_alarm
+ *		Body of pg_retire_alarm_handler().
+ */
+static void
+handle_alarm(void)
+{
+	/*
+	 * The timer has been disarmed just when it fired.
+	 */
+	if (alarm_state == PGRETIRE_ALARM_DISARMED)
+		return;
+
+	count_event(MyStats, PGRETIRE_COUNTER_ALARMS);
+
+	/*
+	 * If query has been already canceled or the backend is terminating,
+	 * do not do sanity check.
+	 */
+	RETURN_IF_INTERRUPT_PENDING;
+
+	/*
+	 * The statement has run for an interval, let the kernel watch the
+	 * client closely too. Short statements never get here.
+	 */
+	if (!sockopts_tightened)
+		tighten_tcp_sockopts();
+
+	if (alarm_state == PGRETIRE_ALARM_ARMED && reader_stalled())
+	{
+		/*
+		 * The client has read nothing for pg_retire.stall_timeout. The
+		 * backend may be blocked in a write, where a cancel is not
+		 * accepted, so give up the session.
+		 */
+		mark_client_down(MySlot);
+		terminateStalledSession();
+		return;
+	}
+
+	/*
+	 * The monitor worker watches the client of a running statement, only
+	 * stalls are checked here. It leaves a session idle in transaction
+	 * alone, so that is probed here in any case.
+	 */
+	if (alarm_state == PGRETIRE_ALARM_ARMED && socket_is_watched())
+	{
+		maybeScheduleAlarm();
+		return;
+	}
+
+	if (doSanityCheck(false))
+	{
+		/*
+		 * If current transaction is still running, reschedule alarm.
+		 * Because sanity check may be needed more than one time.
+		 */
+		maybeScheduleAlarm();
+	}
+	else if (alarm_state == PGRETIRE_ALARM_IDLE)
+	{
+		/*
+		 * A cancel is ignored while reading a command, and there is no
+		 * statement to cancel anyway. Give up the session, which releases
+		 * the locks of its transaction.
+		 */
+		terminateSession();
+		probe_same_host(MySlot);
+	}
+	else
+	{
+		/*
+		 * The client may be down, so cancel current transaction here.
+		 */
+		mark_client_down(MySlot);
+		cancelTransaction();
+		probe_same_host(MySlot);
+	}
+}
+
+/*
+ * pg_retire_probe_request_handler
+ *		SIGUSR2 handler, probe the client at the request of the monitor
+ *		worker.
+ *
+ * The worker sends SIGUSR2 to backends at the root of the lock wait graph,
+ * see probe_root_blockers(). If the client is down, the statement is
+ * canceled, or the session is terminated if no statement is running, so
+ * that the locks are released at once.
+ *
+ * SIGALRM is blocked while this runs. If this interrupts the alarm handler,
+ * nothing is done, as the client is being probed already.
+ */
+static void
+pg_retire_probe_request_handler(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	if (in_alarm_handler || !pg_retire_enable || MySlot == NULL)
+	{
+		errno = save_errno;
+		return;
+	}
+
+	if (!ParallelMessagePending && InterruptPending)
+	{
+		errno = save_errno;
+		return;
+	}
+
+	if (!doSanityCheck(true))
+	{
+		if (exec_nesting_level > 0)
+		{
+			mark_client_down(MySlot);
+			cancelTransaction();
+		}
+		else
+			terminateSession();
+	}
+
+	errno = save_errno;
+}
+
+/*
+ * maybeScheduleAlarm
+ *		Reschedule alarm after the timer fired, if still armed.
+ *
+ * The timer stays armed until the statement finishes, because sanity check
+ * may be needed more than one time. Once the statement has finished, the
+ * state is DISARMED and no alarm is scheduled, so a connection kept by a
+ * connection pool costs nothing while idle, unless it is idle in transaction
+ * and pg_retire.idle_in_transaction is on.
+ */
+static bool
+maybeScheduleAlarm(void)
+{
+	if (alarm_state == PGRETIRE_ALARM_DISARMED)
+		return false;
+
+	/*
+	 * The monitor worker watches my client. The TCP options have been
+	 * tightened, so the kernel reports a vanished host to the worker, and
+	 * nothing is left to do here. The state stays ARMED, so that
+	 * disarmAlarm() restores the options when the statement finishes.
+	 */
+	if (alarm_state == PGRETIRE_ALARM_ARMED && socket_is_watched() &&
+		pg_retire_stall_timeout == 0)
+		return false;
+
+	enable_timeout_after(MyTimeoutId, MILLISECONDS(pg_retire_interval));
+
+	return true;
+}
+
+/*
+ * pgrt_doSanityCheck
+ *		Do sanity check of the client.
+ *
+ * In 'write' mode, check if the client is alive by writing a dummy parameter
+ * to the accepted socket descriptor. If the client has been already down,
+ * write will fail. We may not be able to notice in the first write,
+ * because system does not deny to write the half-closed socket.
+ * In such a case, we will notice client down in the second write.
+ *
+ * In 'peek' mode, nothing is written. FIN or RST from the client is found
+ * by looking into the socket, so client down is noticed in the first check.
+ *
+ * In 'tcp_info' mode, nothing is written either. The TCP state kept by the
+ * kernel tells whether the client has closed the connection, and whether
+ * what we sent is being acknowledged, which also reveals a half-open peer
+ * that a write cannot detect. Unix-domain sockets are peeked instead.
+ *
+ * On SSL connections, raw bytes must not be written into the TLS stream.
+ * The dummy message is sent by libpq through the TLS layer at the next
+ * message boundary, and the socket is checked as in 'tcp_info' mode
+ * meanwhile, which works below TLS without disturbing it. During a statement
+ * that sends nothing, that is all the probe does.
+ *
+ * A probe requested by SIGUSR2 (requested = true) is done only once, with
+ * nothing to follow it up, so a write would rarely reveal a dead peer. It
+ * reads the TCP state and peeks the socket instead, as 'tcp_info' mode does,
+ * whatever pg_retire.probe_mode is. Neither sees a host that has gone
+ * silently while nothing is outstanding, so in 'write' mode a dummy message
+ * is also sent in that case if the stream allows. The kernel then
+ * retransmits it to a dead host, which the next probe of the timer or of
+ * the worker finds, instead of never.
+ *
+ * If the client process on this host is known and has exited, the client
+ * is down whatever the socket says.
+ *
+ * If libpq has written to the client since the last check, that already
+ * proves the client alive as much as a probe would, so no probe is done.
+ *
+ * The time spent in a probe is recorded in the probe_cost_ns histogram.
+ * clock_gettime() is async-signal-safe.
+ */
+static bool
+doSanityCheck(bool requested)
+{
+	int status;
+	instr_time start;
+	instr_time duration;
+
+	if (peer_process_exited())
+	{
+		count_event(MyStats, PGRETIRE_COUNTER_PROBES);
+		count_event(MyStats, PGRETIRE_COUNTER_FAILURES);
+		return false;
+	}
+
+	if (pq_made_progress())
+		return true;
+
+	count_event(MyStats, PGRETIRE_COUNTER_PROBES);
+	probe_would_block = false;
+	INSTR_TIME_SET_CURRENT(start);
+
+	if (pg_retire_probe_mode == PGRETIRE_PROBE_TCP_INFO || requested)
+	{
+		status = check_tcp_info(MyProcPort->sock, pg_retire_max_retransmits,
+								MILLISECONDS(Max(pg_retire_interval, 1)),
+								&last_bytes_acked);
+		if (status > 0)
+			status = peek_client_socket(MyProcPort->sock, MyProcPort->ssl_in_use);
+
+		if (status == 0 && requested &&
+			pg_retire_probe_mode == PGRETIRE_PROBE_WRITE &&
+			!MyProcPort->ssl_in_use && pq_at_message_boundary() &&
+			socket_send_queue(MyProcPort->sock) == 0)
+			status = send_dummy_message_to_frontend();
+	}
+	else if (pg_retire_probe_mode == PGRETIRE_PROBE_PEEK)
+		status = peek_client_socket(MyProcPort->sock, MyProcPort->ssl_in_use);
+	else if (MyProcPort->ssl_in_use || !pq_at_message_boundary())
+	{
+		/*
+		 * A message is partially sent, or the connection uses SSL. Writing
+		 * now would break the stream, so let libpq send the dummy message
+		 * at the next message boundary. A statement sending nothing never
+		 * gets there, so check the socket as 'tcp_info' mode does meanwhile.
+		 */
+		probe_deferred = true;
+		status = check_tcp_info(MyProcPort->sock, pg_retire_max_retransmits,
+								MILLISECONDS(Max(pg_retire_interval, 1)),
+								&last_bytes_acked);
+		if (status >= 0)
+			status = peek_client_socket(MyProcPort->sock, MyProcPort->ssl_in_use);
+	}
+	else
+	{
+		/*
+		 * Send a dummy parameter status report to the client.
+		 */
+		status = send_dummy_message_to_frontend();
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	record_timing(PGRETIRE_HIST_PROBE_COST,
+				  (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0));
+
+	if (probe_would_block)
+		count_event(MyStats, PGRETIRE_COUNTER_EAGAIN);
+
+	if (status != 0)
+	{
+		count_event(MyStats, PGRETIRE_COUNTER_FAILURES);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * cancelTransaction
+ *		Cancel current transaction.
+ *
+ * Do what StatementCancelHandler() does on SIGINT, without sending a signal
+ * to itself. The query is canceled at the next CHECK_FOR_INTERRUPTS(), and
+ * setting the latch wakes the backend up if it is waiting for it.
+ */
+static void
+cancelTransaction(void)
+{
+	if (!proc_exit_inprogress)
+	{
+		InterruptPending = true;
+		QueryCancelPending = true;
+	}
+
+	cancel_requested = true;
+	count_event(MyStats, PGRETIRE_COUNTER_CANCELS);
+
+	SetLatch(MyLatch);
+}
+
+/*
+ * terminateSession
+ *		Terminate the session idle in transaction.
+ *
+ * Do what the backend does when a write to the client fails: the session
+ * ends with FATAL "connection to client lost" at the next
+ * CHECK_FOR_INTERRUPTS(), which also happens while waiting for a command.
+ * Nothing is sent to the client then.
+ */
+static void
+terminateSession(void)
+{
+	if (!proc_exit_inprogress)
+	{
+		ClientConnectionLost = true;
+		InterruptPending = true;
+	}
+
+	count_event(MyStats, PGRETIRE_COUNTER_TERMINATIONS);
+
+	SetLatch(MyLatch);
+}
+
+/*
+ * terminateStalledSession
+ *		Terminate the session whose client stopped reading.
+ *
+ * Do what die() does on SIGTERM. A backend blocked in a write to the client
+ * only handles ProcDiePending there, and stops sending to the client then.
+ * The reason is logged by pg_retire_emit_log() before the FATAL message,
+ * which blames an administrator command.
+ */
+static void
+terminateStalledSession(void)
+{
+	if (!proc_exit_inprogress)
+	{
+		stall_terminated = true;
+		ProcDiePending = true;
+		InterruptPending = true;
+	}
+
+	count_event(MyStats, PGRETIRE_COUNTER_TERMINATIONS);
+
+	SetLatch(MyLatch);
+}
+
+/*
+ * reader_stalled
+ *		Return true if the client has read nothing for
+ *		pg_retire.stall_timeout.
+ *
+ * The client makes progress if the send queue of the socket has shrunk
+ * since the last check, or if libpq has been given more output, which it
+ * only takes when there is room. Otherwise data is waiting and the client
+ * does not take it: it has stopped consuming the result, or it is hung but
+ * its TCP stack still acknowledges while advertising a zero window. Both
+ * look alive to every probe, and the backend may be blocked in a write.
+ * Dummy messages of 'write' mode only grow the queue, which is no progress.
+ *
+ * This is checked at each alarm, so the stall is found up to
+ * pg_retire.interval after the timeout.
+ */
+static bool
+reader_stalled(void)
+{
+	uint32 sent = pq_sent_bytes;
+	uint64 now;
+	int outq;
+	bool progress;
+
+	if (pg_retire_stall_timeout <= 0)
+		return false;
+
+	outq = socket_send_queue(MyProcPort->sock);
+	if (outq <= 0)
+	{
+		stall_since = 0;
+		return false;
+	}
+
+	now = now_microsec();
+	progress = (stall_since == 0 || outq < stall_outq ||
+				sent != stall_sent_bytes);
+	stall_outq = outq;
+	stall_sent_bytes = sent;
+
+	if (progress)
+	{
+		stall_since = now;
+		return false;
+	}
+
+	return now - stall_since >= (uint64) pg_retire_stall_timeout * 1000000;
+}
+
+/*
+ * send_dummy_message_to_frontend
+ *		Send dummy parameter status to client.
+ *
+ * To check whether the client is still alive, send a unreserved dummy parameter
+ * to the client. Normally, client receives it and ignores.
+ */
+static int
+send_dummy_message_to_frontend(void)
+{
+#ifdef USE_SSL
+	/*
+	 * Raw bytes must not be written into the TLS stream. SSL connections
+	 * are checked in doSanityCheck() without this.
+	 */
+	if (MyProcPort->ssl_in_use)
+		return 0;
+#endif
+
+	return send_dummy_message(MyProcPort->sock,
+							  PG_PROTOCOL_MAJOR(MyProcPort->proto),
+							  &probe_rest);
+}
+
+/*
+ * Wrappers of PqCommMethods
+ *
+ * They mark libpq busy while it writes to the socket, send a deferred probe
+ * at a message boundary, and record whether data actually went out.
+ */
+static int
+pgrt_pq_flush(void)
+{
+	bool pending;
+	int r;
+
+	pq_busy = true;
+	put_deferred_probe();
+	pending = prev_PqCommMethods->is_send_pending();
+	r = prev_PqCommMethods->flush();
+	pq_busy = false;
+
+	if (r == 0 && pending)
+		pq_flushed = true;
+
+	return r;
+}
+
+static int
+pgrt_pq_flush_if_writable(void)
+{
+	int r;
+
+	pq_busy = true;
+	put_probe_rest();
+	r = prev_PqCommMethods->flush_if_writable();
+	pq_busy = false;
+
+	return r;
+}
+
+static int
+pgrt_pq_putmessage(char msgtype, const char *s, size_t len)
+{
+	int r;
+
+	pq_busy = true;
+	put_deferred_probe();
+	r = prev_PqCommMethods->putmessage(msgtype, s, len);
+	pq_busy = false;
+
+	/* Message type and length word */
+	if (r == 0)
+		pq_sent_bytes += len + 5;
+
+	if (r == 0 && msgtype == 'Z')
+	{
+		/* A portal suspended by Execute with a row limit is no longer run */
+		if (alarm_state == PGRETIRE_ALARM_ARMED)
+			disarmAlarm();
+
+		/* The transaction status 'T', in a transaction block */
+		if (len == 1 && s[0] == 'T')
+			armIdleAlarm();
+	}
+
+	return r;
+}
+
+static void
+pgrt_pq_putmessage_noblock(char msgtype, const char *s, size_t len)
+{
+	pq_busy = true;
+	put_probe_rest();
+	prev_PqCommMethods->putmessage_noblock(msgtype, s, len);
+	pq_busy = false;
+}
+
+static void
+pgrt_pq_startcopyout(void)
+{
+	pq_busy = true;
+	put_probe_rest();
+	pq_busy = false;
+	prev_PqCommMethods->startcopyout();
+	pq_copy_out = true;
+}
+
+static void
+pgrt_pq_endcopyout(bool errorAbort)
+{
+	pq_busy = true;
+	put_probe_rest();
+	prev_PqCommMethods->endcopyout(errorAbort);
+	pq_copy_out = false;
+	pq_busy = false;
+}
+
+/*
+ * install_pq_methods
+ *		Wrap the socket methods of libpq.
+ */
+static void
+install_pq_methods(void)
+{
+	prev_PqCommMethods = PqCommMethods;
+
+	pgrt_PqCommMethods = *PqCommMethods;
+	pgrt_PqCommMethods.flush = pgrt_pq_flush;
+	pgrt_PqCommMethods.flush_if_writable = pgrt_pq_flush_if_writable;
+	pgrt_PqCommMethods.putmessage = pgrt_pq_putmessage;
+	pgrt_PqCommMethods.putmessage_noblock = pgrt_pq_putmessage_noblock;
+	pgrt_PqCommMethods.startcopyout = pgrt_pq_startcopyout;
+	pgrt_PqCommMethods.endcopyout = pgrt_pq_endcopyout;
+
+	PqCommMethods = &pgrt_PqCommMethods;
+}
+
+/*
+ * pq_made_progress
+ *		Return true if libpq has written to the client since the last call.
+ *
+ * libpq flushes its send buffer whenever it fills up, so passing more than
+ * a buffer's worth of messages means at least one successful write.
+ */
+static bool
+pq_made_progress(void)
+{
+	uint32 sent = pq_sent_bytes;
+	bool progress;
+
+	if (prev_PqCommMethods == NULL)
+		return false;
+
+	progress = pq_flushed ||
+		sent - pq_sent_bytes_at_check >= PGRETIRE_PQ_SEND_BUFFER_SIZE;
+
+	pq_flushed = false;
+	pq_sent_bytes_at_check = sent;
+
+	return progress;
+}
+
+/*
+ * pq_at_message_boundary
+ *		Return true if bytes can be written to the socket directly.
+ *
+ * While libpq is writing, or holds unsent bytes of a message in its send
+ * buffer, the stream on the socket may end in the middle of a message.
+ * COPY OUT in protocol version 2 has no message framing at all.
+ */
+static bool
+pq_at_message_boundary(void)
+{
+	if (prev_PqCommMethods == NULL)
+		return true;
+
+	if (pq_busy)
+		return false;
+
+	if (pq_copy_out && PG_PROTOCOL_MAJOR(MyProcPort->proto) < 3)
+		return false;
+
+	return !prev_PqCommMethods->is_send_pending();
+}
+
+/*
+ * put_deferred_probe
+ *		Put the dummy message into the send buffer of libpq.
+ *
+ * Called at a message boundary in the libpq output. Errors are handled by
+ * libpq as for any other message.
+ */
+static void
+put_deferred_probe(void)
+{
+	put_probe_rest();
+
+	if (!probe_deferred)
+		return;
+
+	probe_deferred = false;
+
+	if (pq_copy_out && PG_PROTOCOL_MAJOR(MyProcPort->proto) < 3)
+		return;
+
+	if (PG_PROTOCOL_MAJOR(MyProcPort->proto) >= 3)
+	{
+		static const char body[] = PGRETIRE_DUMMY_PAREMETER_NAME "\0"
+			PGRETIRE_DUMMY_PAREMETER_VALUE;
+
+		(void) prev_PqCommMethods->putmessage('S', body, sizeof(body));
+	}
+	else
+		(void) prev_PqCommMethods->putmessage('N', PGRETIRE_KEEP_ALIVE_MESSAGE,
+											  sizeof(PGRETIRE_KEEP_ALIVE_MESSAGE));
+}
+
+/*
+ * put_probe_rest
+ *		Write the rest of a partly written dummy message to the client.
+ *
+ * The stream on the socket ends in the middle of that message, so it must
+ * be completed before libpq writes anything. The rest is only left by a raw
+ * write while the send buffer of libpq was empty, and every output of libpq
+ * comes here first, so it is written straight to the socket as libpq's own
+ * flush does: secure_write() waits until the socket is writable, handling
+ * interrupts meanwhile. If that fails, libpq notices the broken connection
+ * on its next write. Called while pq_busy is set, so the alarm handler does
+ * not touch probe_rest meanwhile.
+ */
+static void
+put_probe_rest(void)
+{
+	char *p = probe_rest.buf;
+	int len = probe_rest.pos;
+
+	probe_rest.pos = 0;
+
+	while (len > 0)
+	{
+		ssize_t r = secure_write(MyProcPort, p, len);
+
+		if (r <= 0)
+			break;
+
+		p += r;
+		len -= r;
+	}
+}
+
+/*
+ * tighten_tcp_sockopts
+ *		Apply pg_retire's TCP_USER_TIMEOUT and keepalive settings.
+ *
+ * A half-open client is otherwise noticed by the kernel only after the
+ * retransmission timeout, about 15 minutes by default. Options are only
+ * lowered, never raised, and the session values are saved for
+ * restore_tcp_sockopts(). getsockopt() and setsockopt() are
+ * async-signal-safe, so this is called in the alarm handler.
+ */
+static void
+tighten_tcp_sockopts(void)
+{
+	int i;
+
+	if (MyProcPort == NULL || IS_AF_UNIX(MyProcPort->laddr.addr.ss_family))
+		return;
+
+	for (i = 0; i < lengthof(tcp_sockopts); i++)
+	{
+		TcpSockopt *opt = &tcp_sockopts[i];
+		socklen_t len = sizeof(opt->saved);
+
+		if (*opt->value <= 0 || opt->changed)
+			continue;
+
+		if (getsockopt(MyProcPort->sock, IPPROTO_TCP, opt->optname,
+					   &opt->saved, &len) < 0)
+			continue;
+
+		/* Zero means the system default, which is never tighter */
+		if (opt->saved > 0 && opt->saved <= *opt->value)
+			continue;
+
+		if (setsockopt(MyProcPort->sock, IPPROTO_TCP, opt->optname,
+					   opt->value, sizeof(int)) == 0)
+		{
+			opt->changed = true;
+			sockopts_tightened = true;
+		}
+	}
+}
+
+/*
+ * restore_tcp_sockopts
+ *		Put back the session values of options tightened.
+ */
+static void
+restore_tcp_sockopts(void)
+{
+	int i;
+
+	sockopts_tightened = false;
+
+	for (i = 0; i < lengthof(tcp_sockopts); i++)
+	{
+		TcpSockopt *opt = &tcp_sockopts[i];
+
+		if (!opt->changed)
+			continue;
+
+		(void) setsockopt(MyProcPort->sock, IPPROTO_TCP, opt->optname,
+						  &opt->saved, sizeof(int));
+		opt->changed = false;
+	}
+}
+
+/*
+ * pgrt_max_backends
+ *		Number of backends that can have a registry entry.
+ *
+ * MaxBackends has not been computed yet when _PG_init is called, so compute
+ * it in the same way as InitializeMaxBackends().
+ */
+static int
+pgrt_max_backends(void)
+{
+	return MaxConnections + autovacuum_max_workers + 1 +
+		max_worker_processes + max_wal_senders;
+}
+
+/*
+ * pgrt_memsize
+ *		Estimate shared memory space needed.
+ */
+static Size
+pgrt_memsize(void)
+{
+	Size size;
+
+	size = offsetof(PgRetireSharedState, slots);
+	size = add_size(size, mul_size(pgrt_max_backends(), sizeof(PgRetireSlot)));
+	size = add_size(size, mul_size(pgrt_max_backends(),
+								   sizeof(PgRetireBackendStatsPadded)));
+	size = add_size(size, hash_estimate_size(pgrt_max_backends(),
+											 sizeof(PgRetireStatsEntry)));
+	size = add_size(size, offsetof(PgRetireOrphanRing, records));
+	size = add_size(size, mul_size(pg_retire_max_orphan_records,
+								   sizeof(PgRetireOrphan)));
+
+	return size;
+}
+
+/*
+ * pgrt_shmem_startup: shmem_startup_hook
+ *		Allocate or attach to shared memory.
+ */
+static void
+pgrt_shmem_startup(void)
+{
+	bool found;
+	bool stats_found;
+	bool orphans_found;
+	HASHCTL info;
+	PgRetireStatsKey key;
+	PgRetireStatsEntry *entry;
+	int i;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	pgrt_shared = ShmemInitStruct("pg_retire",
+								  offsetof(PgRetireSharedState, slots) +
+								  pgrt_max_backends() * sizeof(PgRetireSlot),
+								  &found);
+	pgrt_backend_stats = ShmemInitStruct("pg_retire backend stats",
+										 pgrt_max_backends() * sizeof(PgRetireBackendStatsPadded),
+										 &stats_found);
+	pgrt_orphans = ShmemInitStruct("pg_retire orphans",
+								   offsetof(PgRetireOrphanRing, records) +
+								   pg_retire_max_orphan_records * sizeof(PgRetireOrphan),
+								   &orphans_found);
+	if (!orphans_found)
+		pgrt_orphans->nrecords = 0;
+	if (!found)
+	{
+		pgrt_shared->lock = &(GetNamedLWLockTranche("pg_retire"))->lock;
+		pgrt_shared->worker_latch = NULL;
+		pgrt_shared->worker_pid = 0;
+		pgrt_shared->nslots = pgrt_max_backends();
+		for (i = 0; i < PGRETIRE_NUM_HISTOGRAMS; i++)
+		{
+			int b;
+
+			for (b = 0; b < PGRETIRE_HIST_BUCKETS; b++)
+				pg_atomic_init_u64(&pgrt_shared->histograms[i].buckets[b], 0);
+		}
+		for (i = 0; i < pgrt_shared->nslots; i++)
+		{
+			PgRetireSlot *slot = &pgrt_shared->slots[i];
+
+			pg_atomic_init_u32(&slot->pid, 0);
+			slot->sock = PGINVALID_SOCKET;
+			slot->family = AF_UNSPEC;
+			slot->inode = 0;
+			slot->peer_pid = 0;
+			pg_atomic_init_u32(&slot->watched, 0);
+			pg_atomic_init_u32(&slot->running, 0);
+			pg_atomic_init_u64(&slot->detected_at, 0);
+		}
+	}
+	if (!stats_found)
+	{
+		for (i = 0; i < pgrt_max_backends(); i++)
+		{
+			PgRetireBackendStats *stats = &pgrt_backend_stats[i].stats;
+			int c;
+
+			stats->userid = InvalidOid;
+			stats->dbid = InvalidOid;
+			for (c = 0; c < PGRETIRE_NUM_COUNTERS; c++)
+				pg_atomic_init_u64(&stats->counters[c], 0);
+		}
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PgRetireStatsKey);
+	info.entrysize = sizeof(PgRetireStatsEntry);
+	pgrt_stats_hash = ShmemInitHash("pg_retire stats hash",
+									pgrt_max_backends(), pgrt_max_backends(),
+									&info,
+									HASH_ELEM | HASH_BLOBS);
+
+	/*
+	 * Counters of a role and database that do not fit in the hashtable go
+	 * to the entry of InvalidOid, which always exists.
+	 */
+	key.userid = InvalidOid;
+	key.dbid = InvalidOid;
+	entry = (PgRetireStatsEntry *) hash_search(pgrt_stats_hash, &key,
+											   HASH_ENTER, &found);
+	if (!found)
+		memset(entry->counters, 0, sizeof(entry->counters));
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * register_slot
+ *		Publish my client socket in the shared registry.
+ *
+ * The slot is owned by this backend only, the pid is written last so that
+ * the worker never sees a half-filled entry.
+ */
+static void
+register_slot(Port *port)
+{
+	PgRetireSlot *slot;
+	Latch *latch;
+	struct stat st;
+
+	if (MyBackendId == InvalidBackendId ||
+		MyBackendId > pgrt_shared->nslots)
+		return;
+
+	slot = &pgrt_shared->slots[MyBackendId - 1];
+	slot->sock = port->sock;
+	slot->family = port->raddr.addr.ss_family;
+	slot->raddr = port->raddr;
+	slot->inode = (fstat(port->sock, &st) == 0) ? (uint64) st.st_ino : 0;
+	slot->peer_pid = peer_pid;
+	slot->probe_on_request = !am_walsender;
+	pg_atomic_write_u32(&slot->watched, 0);
+	pg_atomic_write_u32(&slot->running, 0);
+	pg_atomic_write_u64(&slot->detected_at, 0);
+	pg_write_barrier();
+	pg_atomic_write_u32(&slot->pid, MyProcPid);
+
+	MySlot = slot;
+	MyStats = &pgrt_backend_stats[MyBackendId - 1].stats;
+	on_shmem_exit(unregister_slot, (Datum) 0);
+
+#if defined(HAVE_SYS_PRCTL_H) && defined(PR_SET_PTRACER)
+	/*
+	 * pidfd_getfd(2) requires ptrace access to this process. Under Yama
+	 * ptrace_scope = 1, only a designated process is allowed to do it.
+	 */
+	if (pgrt_shared->worker_pid != 0)
+		(void) prctl(PR_SET_PTRACER, (unsigned long) pgrt_shared->worker_pid,
+					 0, 0, 0);
+#endif
+
+	latch = pgrt_shared->worker_latch;
+	if (latch)
+		SetLatch(latch);
+}
+
+/*
+ * unregister_slot
+ *		Release my registry entry at backend exit.
+ *
+ * This is an on_shmem_exit callback, so that it runs after the transaction
+ * has been aborted by ShutdownPostgres(), whose abort callback still needs
+ * the entry to record a session terminated with FATAL.
+ *
+ * The worker may hold a duplicate of my client socket, which keeps the
+ * connection open until the worker closes it. Wake the worker up so that
+ * it does that immediately.
+ */
+static void
+unregister_slot(int code, Datum arg)
+{
+	Latch *latch;
+
+	if (MySlot == NULL)
+		return;
+
+	fold_backend_stats(MyStats);
+	MyStats = NULL;
+
+	pg_atomic_write_u32(&MySlot->running, 0);
+	slot_running = false;
+	pg_atomic_write_u32(&MySlot->pid, 0);
+	MySlot = NULL;
+
+	latch = pgrt_shared->worker_latch;
+	if (latch)
+		SetLatch(latch);
+}
+
+/*
+ * socket_is_watched
+ *		Return true if the worker is watching my client socket.
+ */
+static bool
+socket_is_watched(void)
+{
+	return MySlot != NULL && pg_atomic_read_u32(&MySlot->watched) != 0;
+}
+
+/*
+ * same_host
+ *		Return true if two TCP client addresses are of the same host.
+ */
+static bool
+same_host(const SockAddr *a, const SockAddr *b)
+{
+	if (a->addr.ss_family != b->addr.ss_family)
+		return false;
+
+	if (a->addr.ss_family == AF_INET)
+		return ((const struct sockaddr_in *) &a->addr)->sin_addr.s_addr ==
+			((const struct sockaddr_in *) &b->addr)->sin_addr.s_addr;
+
+	if (a->addr.ss_family == AF_INET6)
+		return memcmp(&((const struct sockaddr_in6 *) &a->addr)->sin6_addr,
+					  &((const struct sockaddr_in6 *) &b->addr)->sin6_addr,
+					  sizeof(struct in6_addr)) == 0;
+
+	return false;
+}
+
+/*
+ * probe_same_host
+ *		Ask the other backends whose client is on the same host as a client
+ *		found down to probe their clients now.
+ *
+ * When an application host dies, all the connections of its pool go down
+ * together, and would otherwise be found one by one, each at its own phase
+ * of pg_retire.interval. They are sent SIGUSR2, as root lock blockers are,
+ * see pg_retire_probe_request_handler(). A client found down on such a
+ * request does not start another round, so one host costs one round.
+ *
+ * Only reads the registry and sends signals, which is async-signal-safe,
+ * so this is called in the alarm handler. The monitor worker does not call
+ * this: the epoll set only reports clients that closed the connection, not
+ * a dead host, and a sock_diag sweep already looks at every TCP client.
+ * Clients connected over Unix-domain sockets are skipped.
+ */
+static void
+probe_same_host(PgRetireSlot *down)
+{
+	int i;
+
+	if (!pg_retire_probe_same_host || down == NULL ||
+		(down->family != AF_INET && down->family != AF_INET6))
+		return;
+
+	for (i = 0; i < pgrt_shared->nslots; i++)
+	{
+		PgRetireSlot *slot = &pgrt_shared->slots[i];
+		pid_t pid = (pid_t) pg_atomic_read_u32(&slot->pid);
+
+		if (pid == 0 || slot == down)
+			continue;
+
+		pg_read_barrier();
+		if (!slot->probe_on_request || !same_host(&slot->raddr, &down->raddr))
+			continue;
+
+		(void) kill(pid, SIGUSR2);
+	}
+}
+
+/*
+ * count_event
+ *		Count an event of a backend.
+ *
+ * Lock-free, so this can be called in the alarm handler.
+ */
+static void
+count_event(PgRetireBackendStats *stats, PgRetireCounter counter)
+{
+	if (stats != NULL)
+		pg_atomic_fetch_add_u64(&stats->counters[counter], 1);
+}
+
+/*
+ * fold_backend_stats
+ *		Move the counters of an exiting backend to the stats hashtable.
+ *
+ * The counters are zeroed under the lock, so that pg_retire_stats() never
+ * sees them twice, and left ready for the next backend using the slot.
+ *
+ * A shared hashtable grows into the shared memory left for the lock table
+ * when entries are added beyond its size, so a new role and database go to
+ * the entry of InvalidOid once the hashtable is full.
+ */
+static void
+fold_backend_stats(PgRetireBackendStats *stats)
+{
+	PgRetireStatsKey key;
+	PgRetireStatsEntry *entry;
+	bool found;
+	int c;
+
+	key.userid = stats->userid;
+	key.dbid = stats->dbid;
+
+	LWLockAcquire(pgrt_shared->lock, LW_EXCLUSIVE);
+
+	entry = NULL;
+	if (key.userid != InvalidOid)
+	{
+		entry = (PgRetireStatsEntry *) hash_search(pgrt_stats_hash, &key,
+												   HASH_FIND, &found);
+		if (entry == NULL &&
+			hash_get_num_entries(pgrt_stats_hash) < pgrt_max_backends())
+			entry = (PgRetireStatsEntry *) hash_search(pgrt_stats_hash, &key,
+													   HASH_ENTER, &found);
+	}
+	if (entry == NULL)
+	{
+		key.userid = InvalidOid;
+		key.dbid = InvalidOid;
+		entry = (PgRetireStatsEntry *) hash_search(pgrt_stats_hash, &key,
+												   HASH_FIND, &found);
+	}
+	else if (!found)
+		memset(entry->counters, 0, sizeof(entry->counters));
+
+	for (c = 0; c < PGRETIRE_NUM_COUNTERS; c++)
+		entry->counters[c] += pg_atomic_exchange_u64(&stats->counters[c], 0);
+
+	stats->userid = InvalidOid;
+	stats->dbid = InvalidOid;
+
+	LWLockRelease(pgrt_shared->lock);
+}
+
+/*
+ * now_microsec
+ *		Current time of the monotonic clock in microseconds.
+ *
+ * The clock is shared by all processes on Linux, so a time taken by the
+ * monitor worker can be compared with one taken by a backend.
+ */
+static uint64
+now_microsec(void)
+{
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	return INSTR_TIME_GET_MICROSEC(now);
+}
+
+/*
+ * mark_client_down
+ *		Record when the client of a backend was first found down.
+ */
+static void
+mark_client_down(PgRetireSlot *slot)
+{
+	uint64 expected = 0;
+
+	if (slot != NULL)
+		pg_atomic_compare_exchange_u64(&slot->detected_at, &expected,
+									   now_microsec());
+}
+
+/*
+ * take_orphan_baseline
+ *		Remember resource usage at the start of a top-level statement.
+ *
+ * ExecutorRun and ExecutorFinish of one statement share the baseline. This
+ * costs a getrusage() call per statement, so it is only done when canceled
+ * statements are recorded.
+ */
+static void
+take_orphan_baseline(uint64 queryId)
+{
+	TimestampTz stmt_start;
+
+	if (!pg_retire_enable || pg_retire_max_orphan_records == 0)
+		return;
+
+	stmt_start = GetCurrentStatementStartTimestamp();
+	if (stmt_start == orphan_baseline.stmt_start)
+		return;
+
+	orphan_baseline.stmt_start = stmt_start;
+	orphan_baseline.queryid = queryId;
+	orphan_baseline.bufusage = pgBufferUsage;
+	if (getrusage(RUSAGE_SELF, &orphan_baseline.rusage) < 0)
+		orphan_baseline.stmt_start = 0;
+}
+
+static int64
+timeval_diff_us(const struct timeval *end, const struct timeval *start)
+{
+	return (int64) (end->tv_sec - start->tv_sec) * 1000000 +
+		(end->tv_usec - start->tv_usec);
+}
+
+/*
+ * record_orphan
+ *		Add the statement just canceled to the orphan ring.
+ *
+ * Called when a transaction aborts after the client was found down. If no
+ * baseline was taken for the statement, only its identity and elapsed time
+ * are recorded.
+ */
+static void
+record_orphan(void)
+{
+	PgRetireOrphan *rec;
+	TimestampTz now;
+	TimestampTz stmt_start;
+	struct rusage rusage;
+	bool has_usage;
+
+	if (pgrt_orphans == NULL || pg_retire_max_orphan_records == 0)
+		return;
+
+	now = GetCurrentTimestamp();
+	stmt_start = GetCurrentStatementStartTimestamp();
+	has_usage = (orphan_baseline.stmt_start == stmt_start &&
+				 getrusage(RUSAGE_SELF, &rusage) == 0);
+
+	LWLockAcquire(pgrt_shared->lock, LW_EXCLUSIVE);
+
+	rec = &pgrt_orphans->records[pgrt_orphans->nrecords % pg_retire_max_orphan_records];
+	pgrt_orphans->nrecords++;
+
+	rec->canceled_at = now;
+	rec->pid = MyProcPid;
+	rec->userid = GetSessionUserId();
+	rec->dbid = MyDatabaseId;
+	rec->queryid = has_usage ? orphan_baseline.queryid : 0;
+	strlcpy(rec->application_name, application_name ? application_name : "",
+			NAMEDATALEN);
+	rec->elapsed = now - stmt_start;
+	rec->has_usage = has_usage;
+	if (has_usage)
+	{
+		BufferUsage *start = &orphan_baseline.bufusage;
+
+		rec->user_time = timeval_diff_us(&rusage.ru_utime,
+										 &orphan_baseline.rusage.ru_utime);
+		rec->system_time = timeval_diff_us(&rusage.ru_stime,
+										   &orphan_baseline.rusage.ru_stime);
+		rec->shared_blks_hit = pgBufferUsage.shared_blks_hit - start->shared_blks_hit;
+		rec->shared_blks_read = pgBufferUsage.shared_blks_read - start->shared_blks_read;
+		rec->local_blks_hit = pgBufferUsage.local_blks_hit - start->local_blks_hit;
+		rec->local_blks_read = pgBufferUsage.local_blks_read - start->local_blks_read;
+		rec->temp_blks_written = pgBufferUsage.temp_blks_written - start->temp_blks_written;
+	}
+
+	LWLockRelease(pgrt_shared->lock);
+}
+
+/*
+ * histogram_bucket
+ *		Bucket of a value, see PGRETIRE_HIST_BUCKETS.
+ */
+static int
+histogram_bucket(uint64 value)
+{
+	int msb;
+
+	if (value < PGRETIRE_HIST_SUB_BUCKETS)
+		return (int) value;
+
+	msb = pg_leftmost_one_pos64(value);
+	if (msb >= PGRETIRE_HIST_MAX_BITS)
+		return PGRETIRE_HIST_BUCKETS - 1;
+
+	return (msb - PGRETIRE_HIST_SUB_BITS + 1) * PGRETIRE_HIST_SUB_BUCKETS +
+		(int) ((value >> (msb - PGRETIRE_HIST_SUB_BITS)) & (PGRETIRE_HIST_SUB_BUCKETS - 1));
+}
+
+/*
+ * histogram_lower_bound
+ *		Smallest value that goes to the bucket.
+ */
+static uint64
+histogram_lower_bound(int bucket)
+{
+	int shift;
+
+	if (bucket < PGRETIRE_HIST_SUB_BUCKETS)
+		return (uint64) bucket;
+
+	shift = bucket / PGRETIRE_HIST_SUB_BUCKETS - 1;
+
+	return ((uint64) (PGRETIRE_HIST_SUB_BUCKETS + bucket % PGRETIRE_HIST_SUB_BUCKETS)) << shift;
+}
+
+/*
+ * record_timing
+ *		Add a value to a histogram.
+ *
+ * Lock-free, so this can be called in the alarm handler.
+ */
+static void
+record_timing(PgRetireHistogramId id, uint64 value)
+{
+	if (pgrt_shared == NULL)
+		return;
+
+	pg_atomic_fetch_add_u64(&pgrt_shared->histograms[id].buckets[histogram_bucket(value)], 1);
+}
+
+#ifdef USE_SOCK_DIAG
+/*
+ * find_socket_owner
+ *		Find a process that has a socket of the inode number open.
+ *
+ * This runs while the connection is authenticated, so the scan is bounded.
+ * Only processes of the user owning the socket, as sock_diag reports it, are
+ * searched, at most PGRETIRE_MAX_PEER_SCAN of them, and only those whose
+ * descriptors we are allowed to read.
+ */
+static pid_t
+find_socket_owner(uint64 inode, uid_t uid)
+{
+	char target[64];
+	DIR *procdir;
+	struct dirent *de;
+	pid_t owner = 0;
+	int scanned = 0;
+
+	snprintf(target, sizeof(target), "socket:[" UINT64_FORMAT "]", inode);
+
+	procdir = AllocateDir("/proc");
+	while (owner == 0 && scanned < PGRETIRE_MAX_PEER_SCAN &&
+		   (de = ReadDirExtended(procdir, "/proc", DEBUG1)) != NULL)
+	{
+		char fddir[MAXPGPATH];
+		DIR *fds;
+		struct dirent *fde;
+		struct stat st;
+		pid_t pid = (pid_t) atoi(de->d_name);
+
+		if (pid <= 0 || pid == MyProcPid)
+			continue;
+
+		snprintf(fddir, sizeof(fddir), "/proc/%d", (int) pid);
+		if (stat(fddir, &st) < 0 || st.st_uid != uid)
+			continue;
+		scanned++;
+
+		snprintf(fddir, sizeof(fddir), "/proc/%d/fd", (int) pid);
+		fds = AllocateDir(fddir);
+		while ((fde = ReadDirExtended(fds, fddir, DEBUG1)) != NULL)
+		{
+			char path[MAXPGPATH];
+			char link[64];
+			ssize_t len;
+
+			if (fde->d_name[0] == '.')
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", fddir, fde->d_name);
+			len = readlink(path, link, sizeof(link) - 1);
+			if (len < 0)
+				continue;
+			link[len] = '\0';
+
+			if (strcmp(link, target) == 0)
+			{
+				owner = pid;
+				break;
+			}
+		}
+		FreeDir(fds);
+	}
+	FreeDir(procdir);
+
+	return owner;
+}
+
+/*
+ * Client end of a loopback TCP connection to be found.
  */
-static int
-flush_cbuf(CharBuffer *cb, Port *port)
+typedef struct LoopbackPeer
 {
-	int wlen;
-	int offset;
-	int r;
+	const SockAddr *client;		/* remote address of the backend */
+	const SockAddr *server;		/* local address of the backend */
+	uint64		inode;			/* inode number of the client socket */
+	uid_t		uid;			/* user owning the client socket */
+} LoopbackPeer;
+
+static bool
+diag_addr_equal(const __be32 *diag_addr, const SockAddr *addr)
+{
+	if (addr->addr.ss_family == AF_INET)
+		return diag_addr[0] == ((const struct sockaddr_in *) &addr->addr)->sin_addr.s_addr;
+
+	return memcmp(diag_addr, &((const struct sockaddr_in6 *) &addr->addr)->sin6_addr,
+				  sizeof(struct in6_addr)) == 0;
+}
+
+static void
+loopback_peer_callback(const struct inet_diag_msg *msg, const struct tcp_info *info,
+					   Size infolen, void *arg)
+{
+	LoopbackPeer *peer = (LoopbackPeer *) arg;
+
+	if (diag_addr_equal(msg->id.idiag_src, peer->client) &&
+		diag_addr_equal(msg->id.idiag_dst, peer->server))
+	{
+		peer->inode = msg->idiag_inode;
+		peer->uid = msg->idiag_uid;
+	}
+}
+
+/*
+ * find_loopback_peer
+ *		Find the client process of a loopback TCP connection.
+ *
+ * The client end of the connection has the ports swapped. Its inode number
+ * and owner are looked up through sock_diag, then the process holding it
+ * among the processes of that owner in /proc.
+ */
+static pid_t
+find_loopback_peer(Port *port)
+{
+	LoopbackPeer peer;
+	int family = port->raddr.addr.ss_family;
+	uint16 client_port;
+	uint16 server_port;
+
+	if (family == AF_INET)
+	{
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) &port->raddr.addr;
+
+		if ((ntohl(sin->sin_addr.s_addr) >> 24) != 127)
+			return 0;
+		client_port = ntohs(sin->sin_port);
+		server_port = ntohs(((const struct sockaddr_in *) &port->laddr.addr)->sin_port);
+	}
+	else if (family == AF_INET6)
+	{
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) &port->raddr.addr;
+
+		if (!IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr))
+			return 0;
+		client_port = ntohs(sin6->sin6_port);
+		server_port = ntohs(((const struct sockaddr_in6 *) &port->laddr.addr)->sin6_port);
+	}
+	else
+		return 0;
+
+	peer.client = &port->raddr;
+	peer.server = &port->laddr;
+	peer.inode = 0;
 
-	if (cb->pos == 0)
+	if (sock_diag_dump(family, client_port, server_port,
+					   loopback_peer_callback, &peer) < 0 || peer.inode == 0)
 		return 0;
 
-	wlen = cb->pos;
-	offset = 0;
+	return find_socket_owner(peer.inode, peer.uid);
+}
+#endif							/* USE_SOCK_DIAG */
+
+/*
+ * resolve_peer_process
+ *		Open a pidfd of the client process if it runs on this host.
+ *
+ * The client process of a Unix-domain socket is given by SO_PEERCRED. That
+ * of a loopback TCP connection is found by socket inode. Once the process
+ * exits, the pidfd becomes readable, which is noticed without probing the
+ * socket, immediately by the epoll monitor worker.
+ */
+static void
+resolve_peer_process(Port *port)
+{
+#ifdef USE_PIDFD
+	pid_t pid = 0;
+
+	if (pg_retire_peer_process == PGRETIRE_PEER_OFF)
+		return;
+
+	if (IS_AF_UNIX(port->raddr.addr.ss_family))
+	{
+#ifdef SO_PEERCRED
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+
+		if (getsockopt(port->sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+			pid = cred.pid;
+#endif
+	}
+#ifdef USE_SOCK_DIAG
+	else if (pg_retire_peer_process == PGRETIRE_PEER_ALL)
+		pid = find_loopback_peer(port);
+#endif
+
+	if (pid <= 0)
+		return;
+
+	/* The pidfd is kept for the session, count it against max_files_per_process */
+	if (!AcquireExternalFD())
+		return;
+
+	peer_pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (peer_pidfd < 0)
+	{
+		ReleaseExternalFD();
+		return;
+	}
+
+	peer_pid = pid;
+
+	ereport(DEBUG3,
+			(errmsg("pg_retire watches client process %d", (int) pid)));
+#endif
+}
+
+/*
+ * peer_process_exited
+ *		Return true if the client process on this host has exited.
+ *
+ * poll() is async-signal-safe, so this can be called in the alarm handler.
+ */
+static bool
+peer_process_exited(void)
+{
+	struct pollfd pfd;
+
+	if (peer_pidfd < 0)
+		return false;
+
+	pfd.fd = peer_pidfd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * signal_backend
+ *		Send a signal to another backend, like pg_cancel_backend() does.
+ *
+ * Only for SIGINT and SIGTERM. Children of the backend, e.g. the shell of
+ * COPY ... PROGRAM, keep the default action of other signals, so SIGUSR2 is
+ * sent to the backend alone.
+ */
+static void
+signal_backend(pid_t pid, int sig)
+{
+#ifdef HAVE_SETSID
+	/* Try to signal whole process group */
+	if (kill(-pid, sig) == 0)
+		return;
+#endif
+	kill(pid, sig);
+}
+
+/*
+ * pg_retire_worker_main
+ *		Entry point of the monitor worker.
+ */
+void
+pg_retire_worker_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	pgrt_shared->worker_pid = MyProcPid;
+	pg_write_barrier();
+	pgrt_shared->worker_latch = MyLatch;
+	before_shmem_exit(worker_shmem_exit, (Datum) 0);
+
+	switch (pg_retire_worker_mode)
+	{
+		case PGRETIRE_WORKER_EPOLL:
+#ifdef USE_EPOLL_MONITOR
+			epoll_monitor_loop();
+#else
+			ereport(LOG,
+					(errmsg("pg_retire.worker_mode = epoll is not supported on this platform")));
+#endif
+			break;
+
+		case PGRETIRE_WORKER_SOCK_DIAG:
+#ifdef USE_SOCK_DIAG
+			sock_diag_monitor_loop();
+#else
+			ereport(LOG,
+					(errmsg("pg_retire.worker_mode = sock_diag is not supported on this platform")));
+#endif
+			break;
+
+		default:
+			blocker_monitor_loop();
+			break;
+	}
+
+	/* Exit code 0 means that the worker is not restarted */
+	proc_exit(0);
+}
+
+/*
+ * worker_shmem_exit
+ *		Hand the clients back to their backends when the worker exits.
+ *
+ * Backends skip their own probes while their socket is watched, so every
+ * flag must be cleared however the worker exits, also on error.
+ */
+static void
+worker_shmem_exit(int code, Datum arg)
+{
+	int i;
+
+	pgrt_shared->worker_latch = NULL;
+	pgrt_shared->worker_pid = 0;
+
+	for (i = 0; i < pgrt_shared->nslots; i++)
+		pg_atomic_write_u32(&pgrt_shared->slots[i].watched, 0);
+}
+
+/*
+ * blocker_monitor_loop
+ *		Main loop of the worker when pg_retire.worker_mode is off.
+ *
+ * The worker only runs then for pg_retire.blocker_interval.
+ */
+static void
+blocker_monitor_loop(void)
+{
+	TimestampTz next_check = 0;
+
+	ereport(LOG,
+			(errmsg("pg_retire monitor started watching lock blockers")));
+
+	while (!ShutdownRequestPending)
+	{
+		long timeout;
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		timeout = maybe_probe_blockers(&next_check);
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_EXIT_ON_PM_DEATH |
+						 (timeout >= 0 ? WL_TIMEOUT : 0),
+						 timeout, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+}
+
+/*
+ * maybe_probe_blockers
+ *		Probe root blockers if pg_retire.blocker_interval has elapsed since
+ *		the last check.
+ *
+ * Returns milliseconds until the next check, or -1 if the check is disabled.
+ */
+static long
+maybe_probe_blockers(TimestampTz *next_check)
+{
+	TimestampTz now;
+
+	if (pg_retire_blocker_interval <= 0)
+		return -1;
+
+	now = GetCurrentTimestamp();
+	if (now >= *next_check)
+	{
+		probe_root_blockers();
+		*next_check = TimestampTzPlusMilliseconds(now, pg_retire_blocker_interval);
+	}
+
+	return TimestampDifferenceMilliseconds(GetCurrentTimestamp(), *next_check);
+}
+
+static int
+pid_cmp(const void *a, const void *b)
+{
+	int pa = *(const int *) a;
+	int pb = *(const int *) b;
+
+	return (pa > pb) - (pa < pb);
+}
+
+static int
+lock_instance_cmp(const void *a, const void *b)
+{
+	const LockInstanceData *la = *(LockInstanceData *const *) a;
+	const LockInstanceData *lb = *(LockInstanceData *const *) b;
+
+	return memcmp(&la->locktag, &lb->locktag, sizeof(LOCKTAG));
+}
+
+/*
+ * probe_root_blockers
+ *		Ask the backends at the root of the lock wait graph to probe their
+ *		clients now.
+ *
+ * A backend blocks a waiter if it holds the same lock in a mode that
+ * conflicts with the requested one, and is a root blocker if it is not
+ * waiting itself. As in pg_blocking_pids(), members of a lock group are
+ * represented by the leader. Waiters queued ahead of others are not
+ * regarded as blockers, as they are waiting themselves.
+ *
+ * The instances are sorted by lock, so this costs O(n log n) in the number
+ * of locks held, plus the holders of each lock waited for per waiter.
+ * Nothing but one pass is done while no one waits.
+ *
+ * A dead client of a root blocker can freeze every backend behind it, so
+ * such backends are sent SIGUSR2, on which they probe their client at once
+ * and give up the locks if it is down, see
+ * pg_retire_probe_request_handler().
+ */
+static void
+probe_root_blockers(void)
+{
+	static MemoryContext blocker_context = NULL;
+	MemoryContext oldcontext;
+	LockData   *lockData;
+	LockInstanceData **sorted;
+	bool	   *blocking;
+	int		   *waiters;
+	int		   *roots;
+	int			nwaiters = 0;
+	int			nroots = 0;
+	int			start;
+	int			end;
+	int			i;
+	int			j;
+
+	if (blocker_context == NULL)
+		blocker_context = AllocSetContextCreate(TopMemoryContext,
+												"pg_retire blockers",
+												ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(blocker_context);
+
+	lockData = GetLockStatusData();
+	waiters = palloc(sizeof(int) * Max(lockData->nelements, 1));
+	for (i = 0; i < lockData->nelements; i++)
+	{
+		if (lockData->locks[i].waitLockMode != NoLock)
+			waiters[nwaiters++] = lockData->locks[i].leaderPid;
+	}
+
+	if (nwaiters == 0)
+		goto done;
+
+	qsort(waiters, nwaiters, sizeof(int), pid_cmp);
+
+	/*
+	 * Group the instances by lock, so that a waiter is only compared with
+	 * the holders of the same lock.
+	 */
+	sorted = palloc(sizeof(LockInstanceData *) * lockData->nelements);
+	for (i = 0; i < lockData->nelements; i++)
+		sorted[i] = &lockData->locks[i];
+	qsort(sorted, lockData->nelements, sizeof(LockInstanceData *),
+		  lock_instance_cmp);
+
+	blocking = palloc0(sizeof(bool) * lockData->nelements);
+	for (start = 0; start < lockData->nelements; start = end)
+	{
+		for (end = start + 1; end < lockData->nelements; end++)
+		{
+			if (lock_instance_cmp(&sorted[start], &sorted[end]) != 0)
+				break;
+		}
+
+		for (i = start; i < end; i++)
+		{
+			LockInstanceData *waiter = sorted[i];
+			LOCKMASK	conflicts;
+
+			if (waiter->waitLockMode == NoLock)
+				continue;
+
+			conflicts = GetLockTagsMethodTable(&waiter->locktag)->conflictTab[waiter->waitLockMode];
+
+			for (j = start; j < end; j++)
+			{
+				LockInstanceData *holder = sorted[j];
+
+				if ((holder->holdMask & conflicts) != 0 &&
+					holder->leaderPid != waiter->leaderPid)
+					blocking[j] = true;
+			}
+		}
+	}
+
+	/* Blockers that are not waiting themselves */
+	roots = palloc(sizeof(int) * lockData->nelements);
+	for (j = 0; j < lockData->nelements; j++)
+	{
+		int pid = sorted[j]->leaderPid;
+
+		if (blocking[j] &&
+			bsearch(&pid, waiters, nwaiters, sizeof(int), pid_cmp) == NULL)
+			roots[nroots++] = pid;
+	}
+
+	qsort(roots, nroots, sizeof(int), pid_cmp);
+
+	for (i = 0; nroots > 0 && i < pgrt_shared->nslots; i++)
+	{
+		PgRetireSlot *slot = &pgrt_shared->slots[i];
+		int pid = (int) pg_atomic_read_u32(&slot->pid);
+
+		if (pid == 0)
+			continue;
+
+		pg_read_barrier();
+		if (!slot->probe_on_request ||
+			bsearch(&pid, roots, nroots, sizeof(int), pid_cmp) == NULL)
+			continue;
+
+		ereport(DEBUG1,
+				(errmsg("pg_retire asked blocking process %d to probe its client",
+						pid)));
+		(void) kill(pid, SIGUSR2);
+	}
+
+done:
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(blocker_context);
+}
+
+#ifdef USE_EPOLL_MONITOR
+/*
+ * Client socket duplicated into the worker.
+ */
+typedef struct WatchedSocket
+{
+	pid_t	pid;				/* owner backend, 0 if not adopted */
+	int		fd;					/* duplicated socket, -1 if not watched */
+	int		peer_pidfd;			/* pidfd of the client process, or -1 */
+} WatchedSocket;
+
+/* Set in epoll data for events on peer_pidfd */
+#define PEER_PROCESS_EVENT	0x80000000
+
+/*
+ * adopt_socket
+ *		Duplicate a backend's client socket into the worker.
+ *
+ * Returns the new descriptor, or -1 if the socket cannot be duplicated,
+ * in which case the backend keeps watching the client by itself.
+ */
+static int
+adopt_socket(pid_t pid, pgsocket sock)
+{
+	int pidfd;
+	int fd;
+
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd < 0)
+		return -1;
+
+	fd = syscall(SYS_pidfd_getfd, pidfd, sock, 0);
+	close(pidfd);
+
+	if (fd < 0)
+		ereport(DEBUG1,
+				(errmsg("pg_retire could not duplicate client socket of process %d: %m",
+						(int) pid)));
+
+	return fd;
+}
+
+/*
+ * forget_socket
+ *		Stop watching a client socket and close the duplicate.
+ */
+static void
+forget_socket(int epfd, WatchedSocket *ws, PgRetireSlot *slot)
+{
+	if (ws->fd >= 0)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, ws->fd, NULL);
+		close(ws->fd);
+		ws->fd = -1;
+	}
+	if (ws->peer_pidfd >= 0)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, ws->peer_pidfd, NULL);
+		close(ws->peer_pidfd);
+		ws->peer_pidfd = -1;
+	}
+	pg_atomic_write_u32(&slot->watched, 0);
+}
+
+/*
+ * epoll_monitor_loop
+ *		Watch client sockets of all backends in one epoll set.
+ *
+ * A duplicate of each registered client socket is parked in the epoll set.
+ * When a client hangs up, or the kernel gives up on the connection with the
+ * TCP options tightened by the backend, the owner backend is canceled at
+ * once, so no backend needs to probe its client. A pidfd of the client process, if it runs on
+ * this host, is parked too, so its exit is also noticed at once.
+ */
+static void
+epoll_monitor_loop(void)
+{
+	WatchedSocket *watched;
+	struct epoll_event *events;
+	struct rlimit rlim;
+	int nslots = pgrt_shared->nslots;
+	TimestampTz next_blocker_check = 0;
+	int epfd;
+	int i;
+
+	/*
+	 * One descriptor per backend is needed, raise the soft limit as far as
+	 * possible.
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max)
+	{
+		rlim.rlim_cur = rlim.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		ereport(ERROR,
+				(errcode_for_socket_access(),
+				 errmsg("pg_retire could not create epoll set: %m")));
+
+	watched = palloc(sizeof(WatchedSocket) * nslots);
+	events = palloc(sizeof(struct epoll_event) * nslots);
+	for (i = 0; i < nslots; i++)
+	{
+		watched[i].pid = 0;
+		watched[i].fd = -1;
+		watched[i].peer_pidfd = -1;
+	}
+
+	ereport(LOG,
+			(errmsg("pg_retire monitor started watching clients with epoll")));
+
+	while (!ShutdownRequestPending)
+	{
+		int nevents;
+		int rc;
+		long timeout;
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
 
-	for (;;)
-	{
 		/*
-		 * Flush buffer here so that backend can decide whether it
-		 * should terminate itself as soon as possible. This message is a bit,
-		 * so an extra flush won't hurt much, probably...
+		 * Synchronize the epoll set with the registry.
 		 */
+		for (i = 0; i < nslots; i++)
+		{
+			PgRetireSlot *slot = &pgrt_shared->slots[i];
+			WatchedSocket *ws = &watched[i];
+			pid_t pid = (pid_t) pg_atomic_read_u32(&slot->pid);
 
-#ifdef USE_SSL
-		if (port->ssl_in_use)
+			if (ws->pid == pid)
+				continue;
+
+			/* The backend has gone, or the slot has been reused */
+			if (ws->pid != 0)
+				forget_socket(epfd, ws, slot);
+
+			ws->pid = pid;
+			if (pid == 0)
+				continue;
+
+			pg_read_barrier();
+			ws->fd = adopt_socket(pid, slot->sock);
+			if (ws->fd >= 0)
+			{
+				struct epoll_event ev;
+
+				ev.events = EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+				ev.data.u32 = i;
+				if (epoll_ctl(epfd, EPOLL_CTL_ADD, ws->fd, &ev) == 0)
+					pg_atomic_write_u32(&slot->watched, 1);
+				else
+				{
+					close(ws->fd);
+					ws->fd = -1;
+				}
+			}
+
+			if (slot->peer_pid != 0)
+			{
+				ws->peer_pidfd = syscall(SYS_pidfd_open, slot->peer_pid, 0);
+				if (ws->peer_pidfd >= 0)
+				{
+					struct epoll_event ev;
+
+					ev.events = EPOLLIN;
+					ev.data.u32 = i | PEER_PROCESS_EVENT;
+					if (epoll_ctl(epfd, EPOLL_CTL_ADD, ws->peer_pidfd, &ev) < 0)
+					{
+						close(ws->peer_pidfd);
+						ws->peer_pidfd = -1;
+					}
+				}
+			}
+		}
+
+		timeout = maybe_probe_blockers(&next_blocker_check);
+		rc = WaitLatchOrSocket(MyLatch,
+							   WL_LATCH_SET | WL_SOCKET_READABLE | WL_EXIT_ON_PM_DEATH |
+							   (timeout >= 0 ? WL_TIMEOUT : 0),
+							   epfd, timeout, PG_WAIT_EXTENSION);
+
+		if (rc & WL_LATCH_SET)
+			ResetLatch(MyLatch);
+
+		if (!(rc & WL_SOCKET_READABLE))
+			continue;
+
+		nevents = epoll_wait(epfd, events, nslots, 0);
+		for (i = 0; i < nevents; i++)
 		{
-			ereport(DEBUG3,
-					(errmsg("pg_retire does not support use in ssl")));
+			int n = events[i].data.u32 & ~PEER_PROCESS_EVENT;
+			PgRetireSlot *slot = &pgrt_shared->slots[n];
+			WatchedSocket *ws = &watched[n];
+
+			/* Already handled in this round */
+			if (ws->fd < 0 && ws->peer_pidfd < 0)
+				continue;
+
+			/*
+			 * The client has gone. Cancel the backend unless the slot has
+			 * been released meanwhile, and stop watching the socket so that
+			 * the connection can be closed by the backend. An idle backend
+			 * notices the disconnection by itself, which is the normal way
+			 * a session ends, so it is left alone.
+			 */
+			if (ws->pid != 0 && pg_atomic_read_u32(&slot->pid) == ws->pid &&
+				pg_atomic_read_u32(&slot->running) != 0)
+			{
+				if (events[i].data.u32 & PEER_PROCESS_EVENT)
+					ereport(DEBUG1,
+							(errmsg("pg_retire detected exit of client process %d of process %d",
+									(int) slot->peer_pid, (int) ws->pid)));
+				else
+					ereport(DEBUG1,
+							(errmsg("pg_retire detected client down of process %d",
+									(int) ws->pid)));
+				mark_client_down(slot);
+				signal_backend(ws->pid, SIGINT);
+				count_event(&pgrt_backend_stats[n].stats, PGRETIRE_COUNTER_CANCELS);
+			}
+			forget_socket(epfd, ws, slot);
 		}
-		else
-#endif
+	}
+
+	for (i = 0; i < nslots; i++)
+		forget_socket(epfd, &watched[i], &pgrt_shared->slots[i]);
+	close(epfd);
+}
+#endif							/* USE_EPOLL_MONITOR */
+
+#ifdef USE_SOCK_DIAG
+/*
+ * sock_diag_dump
+ *		Dump TCP sockets of a family through NETLINK_SOCK_DIAG.
+ *
+ * Only sockets whose local port is sport and remote port is dport are
+ * dumped, zero matches any port. Listening and TIME_WAIT sockets are
+ * not dumped. The callback is called for each socket with its tcp_info.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+sock_diag_dump(int family, uint16 sport, uint16 dport,
+			   sock_diag_callback callback, void *arg)
+{
+	struct
+	{
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} request;
+	struct sockaddr_nl nladdr;
+	long buf[8192];
+	int fd;
+	int result = -1;
+	bool done = false;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd < 0)
+		return -1;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	memset(&request, 0, sizeof(request));
+	request.nlh.nlmsg_len = sizeof(request);
+	request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.req.sdiag_family = family;
+	request.req.sdiag_protocol = IPPROTO_TCP;
+	request.req.idiag_states = ((1 << (TCP_CLOSING + 1)) - 1) &
+		~((1 << TCP_LISTEN) | (1 << TCP_TIME_WAIT));
+	request.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+	request.req.id.idiag_sport = htons(sport);
+	request.req.id.idiag_dport = htons(dport);
+	request.req.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+	request.req.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+	if (sendto(fd, &request, sizeof(request), 0,
+			   (struct sockaddr *) &nladdr, sizeof(nladdr)) < 0)
+		goto out;
+
+	while (!done)
+	{
+		struct nlmsghdr *h;
+		ssize_t len;
+
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0)
 		{
-			r = write(port->sock, cb->buf + offset, wlen);
+			if (errno == EINTR)
+				continue;
+			goto out;
 		}
 
-		if (r > 0)
+		for (h = (struct nlmsghdr *) buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len))
 		{
-			wlen -= r;
+			struct inet_diag_msg *msg;
+			struct rtattr *attr;
+			const struct tcp_info *info = NULL;
+			Size infolen = 0;
+			int attrlen;
 
-			/* Write completed */
-			if (wlen == 0)
-				return 0;
-			else if (wlen < 0)
+			if (h->nlmsg_type == NLMSG_DONE)
 			{
-				ereport(WARNING,
-						(errmsg("pg_retire failed to write keep alive packet")));
-				return -1;
+				done = true;
+				break;
 			}
-			else
+			if (h->nlmsg_type == NLMSG_ERROR)
+				goto out;
+
+			msg = (struct inet_diag_msg *) NLMSG_DATA(h);
+			attr = (struct rtattr *) (msg + 1);
+			attrlen = h->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+
+			for (; RTA_OK(attr, attrlen); attr = RTA_NEXT(attr, attrlen))
 			{
-				/* Write remained data */
-				offset += r;
-				continue;
+				if (attr->rta_type == INET_DIAG_INFO)
+				{
+					info = (const struct tcp_info *) RTA_DATA(attr);
+					infolen = RTA_PAYLOAD(attr);
+				}
 			}
+
+			callback(msg, info, infolen, arg);
 		}
+	}
 
-		if (errno == EINTR)
-			continue;
+	result = 0;
+
+out:
+	close(fd);
+	return result;
+}
+
+/*
+ * Client socket to be checked in one sweep.
+ */
+typedef struct SweepEntry
+{
+	uint64	inode;				/* inode number of the client socket */
+	pid_t	pid;				/* owner backend */
+	int		slotno;				/* index in the registry */
+	bool	seen;				/* found in the dump */
+	bool	down;				/* the client is regarded as down */
+} SweepEntry;
+
+typedef struct SweepState
+{
+	SweepEntry *entries;		/* sorted by inode */
+	int		nentries;
+} SweepState;
+
+static int
+sweep_entry_cmp(const void *a, const void *b)
+{
+	uint64 ia = ((const SweepEntry *) a)->inode;
+	uint64 ib = ((const SweepEntry *) b)->inode;
+
+	if (ia < ib)
+		return -1;
+	return (ia > ib) ? 1 : 0;
+}
+
+/*
+ * sweep_callback
+ *		Judge a client socket found in the dump.
+ *
+ * CLOSE_WAIT means the client has sent FIN. A socket stuck in
+ * retransmission is regarded as half-open.
+ */
+static void
+sweep_callback(const struct inet_diag_msg *msg, const struct tcp_info *info,
+			   Size infolen, void *arg)
+{
+	SweepState *state = (SweepState *) arg;
+	SweepEntry key;
+	SweepEntry *entry;
+
+	key.inode = msg->idiag_inode;
+	entry = bsearch(&key, state->entries, state->nentries,
+					sizeof(SweepEntry), sweep_entry_cmp);
+	if (entry == NULL)
+		return;
+
+	entry->seen = true;
+
+	if (msg->idiag_state == TCP_CLOSE_WAIT)
+		entry->down = true;
+	else if (pg_retire_max_retransmits > 0 && info != NULL &&
+			 infolen >= offsetof(struct tcp_info, tcpi_retransmits) + 1 &&
+			 info->tcpi_retransmits >= pg_retire_max_retransmits)
+		entry->down = true;
+}
+
+/*
+ * sock_diag_monitor_loop
+ *		Check TCP state of all client sockets once per interval.
+ *
+ * All TCP sockets on the listen port are dumped at once, and mapped to
+ * backends by inode number through the registry. A registered socket that
+ * does not appear in the dump has been reset. Unix-domain sockets are left
+ * to the backend's own timer.
+ */
+static void
+sock_diag_monitor_loop(void)
+{
+	SweepState state;
+	pid_t *canceled;
+	int nslots = pgrt_shared->nslots;
+	TimestampTz next_blocker_check = 0;
+	int i;
+
+	state.entries = palloc(sizeof(SweepEntry) * nslots);
+	canceled = palloc0(sizeof(pid_t) * nslots);
+
+	ereport(LOG,
+			(errmsg("pg_retire monitor started watching clients with sock_diag")));
 
-		if (errno == EAGAIN ||
-			errno == EWOULDBLOCK)
+	while (!ShutdownRequestPending)
+	{
+		TimestampTz next_sweep;
+		bool ok;
+
+		if (ConfigReloadPending)
 		{
-			return 0;
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
 		}
 
 		/*
-		 * There was something wrong.
+		 * Take TCP clients from the registry.
 		 */
-		return -1;
+		state.nentries = 0;
+		for (i = 0; i < nslots; i++)
+		{
+			PgRetireSlot *slot = &pgrt_shared->slots[i];
+			pid_t pid = (pid_t) pg_atomic_read_u32(&slot->pid);
+			SweepEntry *entry;
+
+			if (pid == 0)
+				continue;
+
+			pg_read_barrier();
+			if ((slot->family != AF_INET && slot->family != AF_INET6) ||
+				slot->inode == 0)
+				continue;
+
+			entry = &state.entries[state.nentries++];
+			entry->inode = slot->inode;
+			entry->pid = pid;
+			entry->slotno = i;
+			entry->seen = false;
+			entry->down = false;
+
+			pg_atomic_write_u32(&slot->watched, 1);
+		}
+
+		qsort(state.entries, state.nentries, sizeof(SweepEntry), sweep_entry_cmp);
+
+		ok = (sock_diag_dump(AF_INET, PostPortNumber, 0,
+							 sweep_callback, &state) == 0 &&
+			  sock_diag_dump(AF_INET6, PostPortNumber, 0,
+							 sweep_callback, &state) == 0);
+
+		if (!ok)
+			ereport(DEBUG1,
+					(errmsg("pg_retire could not dump TCP sockets: %m")));
+
+		for (i = 0; ok && i < state.nentries; i++)
+		{
+			SweepEntry *entry = &state.entries[i];
+			PgRetireSlot *slot = &pgrt_shared->slots[entry->slotno];
+
+			if (entry->seen && !entry->down)
+				continue;
+
+			/*
+			 * Cancel once, and only if the backend is still there and runs a
+			 * statement. An idle backend notices a closed connection by
+			 * itself, which is the normal way a session ends.
+			 */
+			if (canceled[entry->slotno] == entry->pid ||
+				pg_atomic_read_u32(&slot->pid) != entry->pid ||
+				pg_atomic_read_u32(&slot->running) == 0)
+				continue;
+
+			ereport(DEBUG1,
+					(errmsg("pg_retire detected client down of process %d",
+							(int) entry->pid)));
+			mark_client_down(slot);
+			signal_backend(entry->pid, SIGINT);
+			count_event(&pgrt_backend_stats[entry->slotno].stats,
+						PGRETIRE_COUNTER_CANCELS);
+			canceled[entry->slotno] = entry->pid;
+		}
+
+		/*
+		 * Sleep until the next sweep, checking root blockers meanwhile. The
+		 * latch is also set whenever a backend registers, which must not
+		 * shorten the interval.
+		 */
+		next_sweep = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+												 MILLISECONDS(Max(pg_retire_interval, 1)));
+		while (!ShutdownRequestPending && !ConfigReloadPending)
+		{
+			long timeout = TimestampDifferenceMilliseconds(GetCurrentTimestamp(),
+														   next_sweep);
+			long blocker_timeout;
+
+			if (timeout <= 0)
+				break;
+
+			blocker_timeout = maybe_probe_blockers(&next_blocker_check);
+			if (blocker_timeout >= 0)
+				timeout = Min(timeout, blocker_timeout);
+
+			(void) WaitLatch(MyLatch,
+							 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							 timeout, PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+		}
+	}
+}
+#endif							/* USE_SOCK_DIAG */
+/*
+ * pg_retire_backend_counters
+ *		Return counters of the current backend.
+ *
+ * nested_statements shows how many statements ran inside top-level ones
+ * without touching the timer.
+ */
+Datum
+pg_retire_backend_counters(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(top_level_statements);
+	values[1] = Int64GetDatum(nested_statements);
+	values[2] = Int64GetDatum(timer_arms);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * pg_retire_stats
+ *		Return counters of exited backends per role and database, and those
+ *		of running backends.
+ *
+ * A role and database can appear more than once, the pg_retire_stats view
+ * adds them up. Counters of exited backends that did not fit in the
+ * hashtable are shown with InvalidOid.
+ */
+Datum
+pg_retire_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	PgRetireStatsEntry *entry;
+	Datum		values[2 + PGRETIRE_NUM_COUNTERS];
+	bool		nulls[2 + PGRETIRE_NUM_COUNTERS];
+	int			i;
+	int			c;
+
+	if (!pgrt_shared || !pgrt_stats_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_retire must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	LWLockAcquire(pgrt_shared->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgrt_stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		values[0] = ObjectIdGetDatum(entry->key.userid);
+		values[1] = ObjectIdGetDatum(entry->key.dbid);
+		for (c = 0; c < PGRETIRE_NUM_COUNTERS; c++)
+			values[2 + c] = Int64GetDatum((int64) entry->counters[c]);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
+
+	for (i = 0; i < pgrt_shared->nslots; i++)
+	{
+		PgRetireBackendStats *stats = &pgrt_backend_stats[i].stats;
+
+		/* Not in use, or no statement has run yet */
+		if (stats->userid == InvalidOid)
+			continue;
+
+		values[0] = ObjectIdGetDatum(stats->userid);
+		values[1] = ObjectIdGetDatum(stats->dbid);
+		for (c = 0; c < PGRETIRE_NUM_COUNTERS; c++)
+			values[2 + c] = Int64GetDatum((int64) pg_atomic_read_u64(&stats->counters[c]));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgrt_shared->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * pg_retire_histograms
+ *		Return non-empty buckets of the timing histograms.
+ *
+ * A bucket holds values from lower_bound up to, but not including,
+ * upper_bound. The upper bound of the last bucket is NULL.
+ */
+Datum
+pg_retire_histograms(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	Datum		values[4];
+	bool		nulls[4];
+	int			i;
+	int			b;
+
+	if (!pgrt_shared)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_retire must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < PGRETIRE_NUM_HISTOGRAMS; i++)
+	{
+		for (b = 0; b < PGRETIRE_HIST_BUCKETS; b++)
+		{
+			uint64 count = pg_atomic_read_u64(&pgrt_shared->histograms[i].buckets[b]);
+
+			if (count == 0)
+				continue;
+
+			memset(nulls, 0, sizeof(nulls));
+			values[0] = CStringGetTextDatum(histogram_names[i]);
+			values[1] = Int64GetDatum((int64) histogram_lower_bound(b));
+			if (b < PGRETIRE_HIST_BUCKETS - 1)
+				values[2] = Int64GetDatum((int64) histogram_lower_bound(b + 1));
+			else
+				nulls[2] = true;
+			values[3] = Int64GetDatum((int64) count);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
 }
 
+/*
+ * pg_retire_orphans
+ *		Return statements canceled because the client was down, oldest
+ *		first.
+ *
+ * Times are in milliseconds. Resource usage is NULL if it was not measured
+ * for the statement.
+ */
+Datum
+pg_retire_orphans(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	Datum		values[14];
+	bool		nulls[14];
+	uint64		first;
+	uint64		n;
+
+	if (!pgrt_shared || !pgrt_orphans)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_retire must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgrt_shared->lock, LW_SHARED);
+
+	first = 0;
+	if (pgrt_orphans->nrecords > pg_retire_max_orphan_records)
+		first = pgrt_orphans->nrecords - pg_retire_max_orphan_records;
+
+	for (n = first; n < pgrt_orphans->nrecords; n++)
+	{
+		PgRetireOrphan *rec = &pgrt_orphans->records[n % pg_retire_max_orphan_records];
+		int			i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = TimestampTzGetDatum(rec->canceled_at);
+		values[i++] = Int32GetDatum(rec->pid);
+		values[i++] = ObjectIdGetDatum(rec->userid);
+		values[i++] = ObjectIdGetDatum(rec->dbid);
+		if (rec->queryid != 0)
+			values[i++] = Int64GetDatum((int64) rec->queryid);
+		else
+			nulls[i++] = true;
+		values[i++] = CStringGetTextDatum(rec->application_name);
+		values[i++] = Float8GetDatum((double) rec->elapsed / 1000.0);
+		if (rec->has_usage)
+		{
+			values[i++] = Float8GetDatum((double) rec->user_time / 1000.0);
+			values[i++] = Float8GetDatum((double) rec->system_time / 1000.0);
+			values[i++] = Int64GetDatum(rec->shared_blks_hit);
+			values[i++] = Int64GetDatum(rec->shared_blks_read);
+			values[i++] = Int64GetDatum(rec->local_blks_hit);
+			values[i++] = Int64GetDatum(rec->local_blks_read);
+			values[i++] = Int64GetDatum(rec->temp_blks_written * BLCKSZ);
+		}
+		else
+		{
+			while (i < 14)
+				nulls[i++] = true;
+		}
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgrt_shared->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
 
 /*
  * Module initialization function
@@ -474,6 +3740,17 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomBoolVariable("pg_retire.idle_in_transaction",
+							"Watch the client of a session idle in transaction.",
+							NULL,
+							&pg_retire_idle_in_transaction,
+							false,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("pg_retire.interval",
 							"Interval seconds to do sanity check of client.",
 							NULL,
@@ -487,13 +3764,213 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomEnumVariable("pg_retire.probe_mode",
+							 "Selects how pg_retire checks the client.",
+							 NULL,
+							 &pg_retire_probe_mode,
+							 PGRETIRE_PROBE_WRITE,
+							 probe_mode_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_retire.max_retransmits",
+							"Retransmissions after which the client is regarded as down.",
+							"Zero disables the check.",
+							&pg_retire_max_retransmits,
+							6,
+							0,
+							255,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_retire.max_orphan_records",
+							"Number of canceled statements kept for pg_retire_orphans().",
+							"Zero disables recording them.",
+							&pg_retire_max_orphan_records,
+							100,
+							0,
+							INT_MAX / 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_retire.tcp_user_timeout",
+							"TCP user timeout applied while a statement is watched.",
+							"Zero leaves the session value unchanged.",
+							&pg_retire_tcp_user_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_retire.keepalives_idle",
+							"TCP keepalive idle time applied while a statement is watched.",
+							"Zero leaves the session value unchanged.",
+							&pg_retire_keepalives_idle,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_retire.keepalives_interval",
+							"TCP keepalive interval applied while a statement is watched.",
+							"Zero leaves the session value unchanged.",
+							&pg_retire_keepalives_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_retire.keepalives_count",
+							"TCP keepalive count applied while a statement is watched.",
+							"Zero leaves the session value unchanged.",
+							&pg_retire_keepalives_count,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_retire.peer_process",
+							 "Selects which client processes on this host are watched directly.",
+							 NULL,
+							 &pg_retire_peer_process,
+							 PGRETIRE_PEER_OFF,
+							 peer_process_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_retire.utility_commands",
+							   "Utility commands watched while they run.",
+							   "A comma-separated list of command tags.",
+							   &pg_retire_utility_commands,
+							   "CREATE INDEX, REFRESH MATERIALIZED VIEW, CREATE TABLE AS, "
+							   "SELECT INTO, CLUSTER, VACUUM, CALL",
+							   PGC_USERSET,
+							   GUC_LIST_INPUT,
+							   check_utility_commands,
+							   assign_utility_commands,
+							   NULL);
+
+	DefineCustomIntVariable("pg_retire.blocker_interval",
+							"Interval of the worker to probe clients of sessions blocking others.",
+							"Zero disables it.",
+							&pg_retire_blocker_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_retire.probe_same_host",
+							"Probe the other clients on the host of a client found down.",
+							NULL,
+							&pg_retire_probe_same_host,
+							true,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_retire.stall_timeout",
+							"Time the client may read nothing before the session is terminated.",
+							"Zero disables it.",
+							&pg_retire_stall_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_retire.worker_mode",
+							 "Selects how the background worker watches clients.",
+							 NULL,
+							 &pg_retire_worker_mode,
+							 PGRETIRE_WORKER_OFF,
+							 worker_mode_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("pg_retire");
+
+	/*
+	 * Request additional shared resources.
+	 */
+	RequestAddinShmemSpace(pgrt_memsize());
+	RequestNamedLWLockTranche("pg_retire", 1);
+
+	/*
+	 * Register the monitor worker.
+	 */
+	if (pg_retire_worker_mode != PGRETIRE_WORKER_OFF ||
+		pg_retire_blocker_interval > 0)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+		worker.bgw_restart_time = 10;	/* seconds */
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_retire");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_retire_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_retire monitor");
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_retire monitor");
+		RegisterBackgroundWorker(&worker);
+	}
+
 	/*
 	 * Install hooks.
 	 */
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pgrt_shmem_startup;
 	prev_ClientAuthentication = ClientAuthentication_hook;
 	ClientAuthentication_hook = pg_retire_ClientAuthentication;
-	prev_post_parse_analyze = post_parse_analyze_hook;
-	post_parse_analyze_hook = pg_retire_post_parse_analyze;
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = pg_retire_ExecutorRun;
+	prev_ExecutorFinish = ExecutorFinish_hook;
+	ExecutorFinish_hook = pg_retire_ExecutorFinish;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = pg_retire_ExecutorEnd;
+	prev_ProcessUtility = ProcessUtility_hook;
+	ProcessUtility_hook = pg_retire_ProcessUtility;
+	prev_emit_log_hook = emit_log_hook;
+	emit_log_hook = pg_retire_emit_log;
 }
 
 /*
@@ -503,6 +3980,11 @@ void
 _PG_fini(void)
 {
 	/* Uninstall hooks. */
+	shmem_startup_hook = prev_shmem_startup_hook;
 	ClientAuthentication_hook = prev_ClientAuthentication;
-	post_parse_analyze_hook = prev_post_parse_analyze;
+	ExecutorRun_hook = prev_ExecutorRun;
+	ExecutorFinish_hook = prev_ExecutorFinish;
+	ExecutorEnd_hook = prev_ExecutorEnd;
+	ProcessUtility_hook = prev_ProcessUtility;
+	emit_log_hook = prev_emit_log_hook;
 }
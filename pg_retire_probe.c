@@ -0,0 +1,380 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_retire_probe.c
+ *		Probes of the client socket.
+ *
+ * These only use the C library and are async-signal-safe, so that they can
+ * be called in the alarm handler, and built without the server for
+ * bench/probe_bench.c.
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_retire/pg_retire_probe.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+#include "pg_retire_probe.h"
+
+/* Content type of a TLS alert record, e.g. close_notify */
+#define TLS_CONTENT_TYPE_ALERT	21
+
+/* POLLRDHUP is Linux specific, recv() with MSG_PEEK is used elsewhere */
+#ifndef POLLRDHUP
+#define POLLRDHUP	0
+#endif
+
+/* TCP_INFO is read through PgRetireTcpInfo, which follows Linux */
+#if defined(__linux__) && defined(TCP_INFO)
+#define USE_TCP_INFO
+#endif
+
+#ifdef USE_TCP_INFO
+/*
+ * Leading part of struct tcp_info of Linux. <netinet/tcp.h> of glibc lacks
+ * newer fields such as tcpi_bytes_acked, and <linux/tcp.h> conflicts with
+ * it. The kernel fills as much as it knows and returns the length.
+ */
+typedef struct PgRetireTcpInfo
+{
+	uint8_t		tcpi_state;
+	uint8_t		tcpi_ca_state;
+	uint8_t		tcpi_retransmits;
+	uint8_t		tcpi_probes;
+	uint8_t		tcpi_backoff;
+	uint8_t		tcpi_options;
+	uint8_t		tcpi_wscale;
+	uint8_t		tcpi_flags;
+
+	uint32_t	tcpi_rto;
+	uint32_t	tcpi_ato;
+	uint32_t	tcpi_snd_mss;
+	uint32_t	tcpi_rcv_mss;
+
+	uint32_t	tcpi_unacked;
+	uint32_t	tcpi_sacked;
+	uint32_t	tcpi_lost;
+	uint32_t	tcpi_retrans;
+	uint32_t	tcpi_fackets;
+
+	uint32_t	tcpi_last_data_sent;
+	uint32_t	tcpi_last_ack_sent;
+	uint32_t	tcpi_last_data_recv;
+	uint32_t	tcpi_last_ack_recv;
+
+	uint32_t	tcpi_pmtu;
+	uint32_t	tcpi_rcv_ssthresh;
+	uint32_t	tcpi_rtt;
+	uint32_t	tcpi_rttvar;
+	uint32_t	tcpi_snd_ssthresh;
+	uint32_t	tcpi_snd_cwnd;
+	uint32_t	tcpi_advmss;
+	uint32_t	tcpi_reordering;
+
+	uint32_t	tcpi_rcv_rtt;
+	uint32_t	tcpi_rcv_space;
+
+	uint32_t	tcpi_total_retrans;
+
+	uint64_t	tcpi_pacing_rate;
+	uint64_t	tcpi_max_pacing_rate;
+	uint64_t	tcpi_bytes_acked;	/* Linux 4.1 or later */
+	uint64_t	tcpi_bytes_received;
+	uint32_t	tcpi_segs_out;
+	uint32_t	tcpi_segs_in;
+
+	uint32_t	tcpi_notsent_bytes;
+} PgRetireTcpInfo;
+
+/* True if the kernel filled the field */
+#define TCP_INFO_HAS(len, field) \
+	((len) >= offsetof(PgRetireTcpInfo, field) + sizeof(((PgRetireTcpInfo *) 0)->field))
+#endif							/* USE_TCP_INFO */
+
+/* Set when the last probe would have blocked */
+volatile sig_atomic_t probe_would_block = 0;
+
+/*
+ * send_dummy_message
+ *		Send dummy parameter status to client.
+ *
+ * To check whether the client is still alive, send a unreserved dummy parameter
+ * to the client. Normally, client receives it and ignores.
+ *
+ * If the send buffer of the socket takes only a part of the message, the
+ * rest is left in cb, and nothing else must be written to the socket before
+ * it. The next call sends it instead of a new message. The caller must
+ * otherwise send it before any other output, see flush_cbuf().
+ */
+int
+send_dummy_message(int sock, int proto_major, CharBuffer *cb)
+{
+	int32_t plen;
+
+	if (cb->pos > 0)
+		return flush_cbuf(cb, sock);
+
+	if (proto_major >= 3)
+	{
+		/*
+		 * Protocol version 3 or later supports ParameterStatus message.
+		 * It starts with 'S', for more detail, see the latest public document.
+		 */
+		write_cbuf(cb, "S", 1);
+		plen = sizeof(PGRETIRE_DUMMY_PAREMETER_NAME) + sizeof(PGRETIRE_DUMMY_PAREMETER_VALUE) + sizeof(plen);
+		plen = htonl(plen);
+		write_cbuf(cb, &plen, sizeof(plen));
+		write_cbuf(cb, PGRETIRE_DUMMY_PAREMETER_NAME, sizeof(PGRETIRE_DUMMY_PAREMETER_NAME));
+		write_cbuf(cb, PGRETIRE_DUMMY_PAREMETER_VALUE, sizeof(PGRETIRE_DUMMY_PAREMETER_VALUE));
+	}
+	else
+	{
+		/*
+		 * Send a message with V2 protocol.
+		 * See the following link about old protocol.
+		 * http://dorn.org/docs/postgres/postgres/protocol21288.htm
+		 */
+		write_cbuf(cb, "N", 1);
+		write_cbuf(cb, PGRETIRE_KEEP_ALIVE_MESSAGE, sizeof(PGRETIRE_KEEP_ALIVE_MESSAGE));
+	}
+
+	return flush_cbuf(cb, sock);
+}
+
+/*
+ * peek_client_socket
+ *		Check the client socket without sending anything.
+ *
+ * When the client has closed the connection, the socket becomes readable
+ * with POLLRDHUP (FIN) or POLLHUP/POLLERR (RST). Where POLLRDHUP is not
+ * available, recv() with MSG_PEEK returns 0 at FIN. Data sent by the client
+ * is left in the socket buffer, so the backend reads it as usual later.
+ *
+ * On SSL connections, the peeked bytes are TLS records. A TLS 1.2 client
+ * closing the session sends an alert record (close_notify) before FIN, and
+ * its content type is not encrypted. TLS 1.3 hides it, but FIN follows
+ * immediately in practice.
+ *
+ * poll() and recv() are async-signal-safe, so this can be called in the
+ * alarm handler.
+ */
+int
+peek_client_socket(int sock, int ssl)
+{
+	struct pollfd pfd;
+	char	c;
+	int		r;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN | POLLRDHUP;
+	pfd.revents = 0;
+
+	do
+	{
+		r = poll(&pfd, 1, 0);
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0)
+		return -1;
+
+	/* Nothing has arrived, the connection is still open */
+	if (r == 0)
+		return 0;
+
+	if (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL))
+		return -1;
+
+	/*
+	 * Readable. Either the client sent data or the connection was closed.
+	 */
+	do
+	{
+		r = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	} while (r < 0 && errno == EINTR);
+
+	if (r > 0)
+		return (ssl && c == TLS_CONTENT_TYPE_ALERT) ? -1 : 0;
+
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		probe_would_block = 1;
+		return 0;
+	}
+
+	/* r == 0 means FIN, otherwise there was something wrong */
+	return -1;
+}
+
+/*
+ * check_tcp_info
+ *		Check the client from TCP_INFO of the socket, without sending anything.
+ *
+ * The client is alive if it acknowledged more data since the last check.
+ * It is down if the connection is no longer established (CLOSE_WAIT after
+ * FIN, CLOSE after RST), if the same segment has been retransmitted
+ * max_retransmits times, or if data is outstanding and nothing
+ * has been acknowledged for stall_ms. The last two mean a half-open
+ * peer, into which write() keeps succeeding until the send buffer fills.
+ *
+ * Returns 0 if alive, -1 if down, and 1 if TCP_INFO is not available, e.g.
+ * for Unix-domain sockets. getsockopt() is async-signal-safe.
+ */
+int
+check_tcp_info(int sock, int max_retransmits, int stall_ms,
+			   uint64_t *last_bytes_acked)
+{
+#ifdef USE_TCP_INFO
+	PgRetireTcpInfo ti;
+	socklen_t len = sizeof(ti);
+
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 ||
+		!TCP_INFO_HAS(len, tcpi_last_ack_recv))
+		return 1;
+
+	if (ti.tcpi_state != TCP_ESTABLISHED)
+		return -1;
+
+	if (TCP_INFO_HAS(len, tcpi_bytes_acked) &&
+		ti.tcpi_bytes_acked != *last_bytes_acked)
+	{
+		*last_bytes_acked = ti.tcpi_bytes_acked;
+		return 0;
+	}
+
+	if (max_retransmits > 0 &&
+		ti.tcpi_retransmits >= max_retransmits)
+		return -1;
+
+	if (ti.tcpi_unacked > 0 &&
+		ti.tcpi_last_ack_recv >= (uint32_t) stall_ms)
+		return -1;
+
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+/*
+ * socket_send_queue
+ *		Return the number of bytes in the send queue of the socket.
+ *
+ * These are bytes written but not yet sent, or sent but not yet
+ * acknowledged by the client, or for Unix-domain sockets not yet read by
+ * it. Returns -1 if this is not available. ioctl() is async-signal-safe.
+ */
+int
+socket_send_queue(int sock)
+{
+#ifdef SIOCOUTQ
+	int outq;
+
+	if (ioctl(sock, SIOCOUTQ, &outq) < 0)
+		return -1;
+
+	return outq;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * write_cbuf
+ */
+int
+write_cbuf(CharBuffer *cb, const void *buf, size_t len)
+{
+	const char *src = buf;
+	char *dst = cb->buf + cb->pos;
+	size_t i = 0;
+	if (cb->pos + len <= WBUFSIZE)
+	{
+		while (i++ < len)
+			*dst++ = *src++;
+
+		cb->pos += len;
+		return len;
+	}
+	return -1;
+}
+
+/*
+ * flush_cbuf
+ *		Write the buffer to the socket without blocking.
+ *
+ * Returns 0 if the buffer was written or would have blocked, and -1 on
+ * error. If the write would have blocked, the unsent rest is kept in the
+ * buffer, as the stream on the socket may now end in the middle of a
+ * message. Otherwise the buffer is emptied.
+ */
+int
+flush_cbuf(CharBuffer *cb, int sock)
+{
+	int wlen;
+	int offset;
+	int r;
+
+	if (cb->pos == 0)
+		return 0;
+
+	wlen = cb->pos;
+	offset = 0;
+
+	for (;;)
+	{
+		/*
+		 * Flush buffer here so that backend can decide whether it
+		 * should terminate itself as soon as possible. This message is a bit,
+		 * so an extra flush won't hurt much, probably...
+		 */
+
+		r = write(sock, cb->buf + offset, wlen);
+
+		if (r > 0)
+		{
+			wlen -= r;
+
+			/* Write completed */
+			if (wlen <= 0)
+			{
+				cb->pos = 0;
+				return 0;
+			}
+
+			/* Write remained data */
+			offset += r;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EAGAIN ||
+			errno == EWOULDBLOCK)
+		{
+			probe_would_block = 1;
+			memmove(cb->buf, cb->buf + offset, wlen);
+			cb->pos = wlen;
+			return 0;
+		}
+
+		/*
+		 * There was something wrong.
+		 */
+		cb->pos = 0;
+		return -1;
+	}
+}
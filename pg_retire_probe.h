@@ -0,0 +1,48 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_retire_probe.h
+ *		Probes of the client socket.
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_retire/pg_retire_probe.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_RETIRE_PROBE_H
+#define PG_RETIRE_PROBE_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size that dummy packet can be stored */
+#define WBUFSIZE	128
+
+/*
+ * Dummy parameter name and value that pg_retire sends to client at the
+ * time of client check.
+ */
+#define PGRETIRE_DUMMY_PAREMETER_NAME	"pg_retire_dummy_name"
+#define PGRETIRE_DUMMY_PAREMETER_VALUE	"pg_retire_dummy_value"
+#define PGRETIRE_KEEP_ALIVE_MESSAGE		"keep alive checking from pg_retire"
+
+/*
+ * Data container for ParameterStatus message.
+ */
+typedef struct CharBuffer
+{
+	char 	buf[WBUFSIZE];	/* Fixed buffer size */
+	int 	pos;			/* Next writing position in buf */
+} CharBuffer;
+
+extern volatile sig_atomic_t probe_would_block;
+
+extern int send_dummy_message(int sock, int proto_major, CharBuffer *cb);
+extern int peek_client_socket(int sock, int ssl);
+extern int check_tcp_info(int sock, int max_retransmits, int stall_ms,
+						  uint64_t *last_bytes_acked);
+extern int socket_send_queue(int sock);
+extern int write_cbuf(CharBuffer *cb, const void *buf, size_t len);
+extern int flush_cbuf(CharBuffer *cb, int sock);
+
+#endif							/* PG_RETIRE_PROBE_H */
@@ -0,0 +1,37 @@
+CREATE EXTENSION pg_retire;
+SET pg_retire.enable = on;
+CREATE TEMP TABLE pg_retire_test (a int);
+
+-- The statement reading the counters arms the timer once
+SELECT timer_arms AS arms FROM pg_retire_backend_counters() \gset
+SELECT timer_arms - :arms AS arms FROM pg_retire_backend_counters();
+
+-- Each statement arms it once, through ExecutorRun and ExecutorFinish
+SELECT timer_arms AS arms, top_level_statements AS stmts
+  FROM pg_retire_backend_counters() \gset
+SELECT 1 AS one;
+INSERT INTO pg_retire_test VALUES (1);
+SELECT timer_arms - :arms AS arms, top_level_statements - :stmts AS stmts
+  FROM pg_retire_backend_counters();
+
+-- Statements in a DO block are nested in it, which arms the timer once
+SELECT timer_arms AS arms, nested_statements AS nested
+  FROM pg_retire_backend_counters() \gset
+DO $$
+BEGIN
+  FOR i IN 1..10 LOOP
+    INSERT INTO pg_retire_test VALUES (i);
+  END LOOP;
+END
+$$;
+SELECT timer_arms - :arms AS arms, nested_statements - :nested AS nested
+  FROM pg_retire_backend_counters();
+
+-- Nothing is armed while disabled
+SET pg_retire.enable = off;
+SELECT timer_arms AS arms FROM pg_retire_backend_counters() \gset
+SELECT 1 AS one;
+SELECT timer_arms - :arms AS arms FROM pg_retire_backend_counters();
+
+DROP TABLE pg_retire_test;
+DROP EXTENSION pg_retire;